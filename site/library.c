@@ -5,9 +5,13 @@
 #include <swebs/swebs.h>
 
 int getResponse(Request *request, Response *response) {
-	printf("%d\n", request->path.fieldCount);
-	for (int i = 0; i < request->path.fieldCount; i++)
-		printf("%s: %s\n", request->path.fields[i].var.data, request->path.fields[i].value.data);
+	long pos = 0;
+	BinaryString var, value;
+	while (nextQuery(request, &pos, &var, &value) > 0)
+		printf("%s: %s\n", var.data, value.data);
+	char *agent = getHeader(request, HEADER_USER_AGENT);
+	if (agent != NULL)
+		printf("User-Agent: %s\n", agent);
 	char *str = request->path.path.data;
 	response->type = BUFFER;
 	response->response.buffer.data = malloc(100);
@@ -0,0 +1,144 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdlib.h>
+#include <string.h>
+
+#include <swebs/arena.h>
+
+#define ALIGN(size) (((size) + sizeof(ArenaAlign) - 1) / sizeof(ArenaAlign) * \
+		sizeof(ArenaAlign))
+
+static ArenaBlock *newBlock(size_t size) {
+	ArenaBlock *ret;
+	ret = malloc(offsetof(ArenaBlock, data) + size);
+	if (ret == NULL)
+		return NULL;
+	ret->next = NULL;
+	ret->size = size;
+	ret->used = 0;
+	return ret;
+}
+
+static void freeBlocks(ArenaBlock *block) {
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+}
+
+int initArena(Arena *arena, size_t size) {
+	arena->size = ALIGN(size);
+	arena->first = arena->current = newBlock(arena->size);
+	if (arena->first == NULL)
+		return 1;
+	arena->total = 0;
+	arena->last = NULL;
+	return 0;
+}
+
+void *arenaAlloc(Arena *arena, size_t size) {
+	ArenaBlock *block = arena->current;
+	char *ret;
+	if (size > (size_t) -1 - sizeof(ArenaAlign) - offsetof(ArenaBlock, data))
+		return NULL;
+	/* Rounding this up would overflow */
+	size = ALIGN(size);
+	if (block == NULL) {
+		block = newBlock(arena->size);
+		if (block == NULL)
+			return NULL;
+		arena->first = arena->current = block;
+	}
+	/* The arena was released */
+	if (block->size - block->used < size) {
+		ArenaBlock *next;
+		next = newBlock(size > block->size ? size : block->size);
+		if (next == NULL)
+			return NULL;
+		block->next = next;
+		arena->current = block = next;
+	}
+	ret = (char *) block->data + block->used;
+	block->used += size;
+	arena->total += size;
+	arena->last = ret;
+	return ret;
+}
+
+void *arenaRealloc(Arena *arena, void *ptr, size_t oldsize, size_t newsize) {
+	ArenaBlock *block = arena->current;
+	void *ret;
+	if (block != NULL && ptr != NULL && ptr == arena->last &&
+			newsize <= block->size) {
+		size_t start = (char *) ptr - (char *) block->data;
+		if (start + ALIGN(newsize) <= block->size) {
+			arena->total += ALIGN(newsize) - (block->used - start);
+			block->used = start + ALIGN(newsize);
+			return ptr;
+		}
+	}
+	/* The last allocation can just take more of its block */
+	ret = arenaAlloc(arena, newsize);
+	if (ret == NULL)
+		return NULL;
+	if (ptr != NULL)
+		memcpy(ret, ptr, oldsize < newsize ? oldsize : newsize);
+	return ret;
+}
+
+void resetArena(Arena *arena) {
+	ArenaBlock *first = arena->first;
+	if (first == NULL)
+		return;
+	if (first->next != NULL) {
+		freeBlocks(first->next);
+		first->next = NULL;
+		if (arena->total > first->size && first->size < ARENA_MAX) {
+			size_t size = first->size;
+			ArenaBlock *bigger;
+			while (size < arena->total && size < ARENA_MAX)
+				size *= 2;
+			if (size > ARENA_MAX)
+				size = ARENA_MAX;
+			bigger = newBlock(size);
+			if (bigger != NULL) {
+				free(first);
+				arena->first = first = bigger;
+				arena->size = size;
+			}
+		}
+	}
+	/* Requests that keep spilling get a bigger first block, so the next
+	 * one hopefully fits in it. */
+	first->used = 0;
+	arena->current = first;
+	arena->total = 0;
+	arena->last = NULL;
+}
+
+void releaseArena(Arena *arena) {
+	freeBlocks(arena->first);
+	arena->first = arena->current = NULL;
+	arena->total = 0;
+	arena->last = NULL;
+}
+
+void freeArena(Arena *arena) {
+	freeBlocks(arena->first);
+}
@@ -0,0 +1,607 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <swebs/util.h>
+#include <swebs/automaton.h>
+
+#define METACHARS ".[]()*+?{}|^$\\"
+#define MAX_DEPTH 64
+/* How deeply groups can nest */
+#define DFA_TABLE (DFA_MAX_STATES * 2)
+
+#define SETBIT(set, c) ((set)[(c) >> 3] |= 1 << ((c) & 7))
+#define TESTBIT(set, c) (((set)[(c) >> 3] >> ((c) & 7)) & 1)
+
+typedef struct {
+	int start;
+	int end;
+} Fragment;
+/* end is always an NFA_EPSILON node that doesn't go anywhere yet */
+
+typedef struct {
+	Automaton *automaton;
+	const char *p;
+	size_t base;
+	int depth;
+} Parser;
+
+static const struct {
+	char *name;
+	int (*test)(int);
+} charclasses[] = {
+	{"alnum", isalnum},
+	{"alpha", isalpha},
+	{"blank", isblank},
+	{"cntrl", iscntrl},
+	{"digit", isdigit},
+	{"graph", isgraph},
+	{"lower", islower},
+	{"print", isprint},
+	{"punct", ispunct},
+	{"space", isspace},
+	{"upper", isupper},
+	{"xdigit", isxdigit},
+};
+
+static int parseAlternation(Parser *parser, Fragment *fragment);
+
+static int newNode(Parser *parser, NfaType type, int out, int arg) {
+	Automaton *automaton = parser->automaton;
+	NfaNode *node;
+	if (automaton->nodecount - parser->base >= NFA_MAX_NODES)
+		return -1;
+	if (automaton->nodecount >= automaton->nodealloc) {
+		automaton->nodealloc = automaton->nodealloc ?
+			automaton->nodealloc * 2 : 64;
+		automaton->nodes = xrealloc(automaton->nodes,
+			automaton->nodealloc * sizeof *automaton->nodes);
+	}
+	node = automaton->nodes + automaton->nodecount;
+	node->type = type;
+	node->out = out;
+	node->arg = arg;
+	return automaton->nodecount++;
+}
+
+static unsigned char *newSet(Parser *parser, int *index) {
+	Automaton *automaton = parser->automaton;
+	if (automaton->setcount >= automaton->setalloc) {
+		automaton->setalloc = automaton->setalloc ?
+			automaton->setalloc * 2 : 16;
+		automaton->sets = xrealloc(automaton->sets,
+				automaton->setalloc * sizeof *automaton->sets);
+	}
+	*index = automaton->setcount++;
+	memset(automaton->sets[*index], 0, sizeof *automaton->sets);
+	return automaton->sets[*index];
+}
+/* The pointer is only good until the next call */
+
+static int single(Parser *parser, NfaType type, int arg, Fragment *fragment) {
+	fragment->end = newNode(parser, NFA_EPSILON, -1, 0);
+	if (fragment->end < 0)
+		return 1;
+	fragment->start = newNode(parser, type, fragment->end, arg);
+	return fragment->start < 0;
+}
+
+static int empty(Parser *parser, Fragment *fragment) {
+	fragment->start = fragment->end = newNode(parser, NFA_EPSILON, -1, 0);
+	return fragment->start < 0;
+}
+
+static void concat(Parser *parser, Fragment *fragment, Fragment *next) {
+	parser->automaton->nodes[fragment->end].out = next->start;
+	fragment->end = next->end;
+}
+
+static int quantify(Parser *parser, Fragment *fragment, char quantifier) {
+	int end, split;
+	end = newNode(parser, NFA_EPSILON, -1, 0);
+	if (end < 0)
+		return 1;
+	split = newNode(parser, NFA_SPLIT, fragment->start, end);
+	if (split < 0)
+		return 1;
+	parser->automaton->nodes[fragment->end].out =
+		quantifier == '?' ? end : split;
+	if (quantifier != '+')
+		fragment->start = split;
+	fragment->end = end;
+	return 0;
+}
+/* quantifier is one of *, + or ? */
+
+static int isQuantifier(char c) {
+	return c == '*' || c == '+' || c == '?' || c == '{';
+}
+
+static int parseBracket(Parser *parser, Fragment *fragment) {
+	unsigned char raw[32];
+	unsigned char *set;
+	const char *p = parser->p + 1;
+	int negate = 0;
+	int first;
+	int i, index;
+	memset(raw, 0, sizeof raw);
+	if (*p == '^') {
+		negate = 1;
+		p++;
+	}
+	for (first = 1;; first = 0) {
+		int low, high;
+		if (*p == '\0')
+			return 1;
+		if (*p == ']' && !first)
+			break;
+		if (p[0] == '[' && p[1] == ':') {
+			const char *end = strstr(p + 2, ":]");
+			size_t j;
+			if (end == NULL)
+				return 1;
+			for (j = 0; j < LEN(charclasses); j++) {
+				const char *name = charclasses[j].name;
+				if (strlen(name) == (size_t) (end - p - 2) &&
+					strncmp(name, p + 2, end - p - 2) == 0)
+					break;
+			}
+			if (j >= LEN(charclasses))
+				return 1;
+			for (i = 1; i < 256; i++)
+				if (charclasses[j].test(i))
+					SETBIT(raw, i);
+			p = end + 2;
+			continue;
+		}
+		if (p[0] == '[' && (p[1] == '.' || p[1] == '='))
+			return 1;
+		low = high = (unsigned char) *p++;
+		if (p[0] == '-' && p[1] != ']' && p[1] != '\0') {
+			high = (unsigned char) p[1];
+			if (high == '[' || high < low)
+				return 1;
+			p += 2;
+		}
+		for (i = low; i <= high; i++)
+			SETBIT(raw, i);
+	}
+	parser->p = p + 1;
+
+	set = newSet(parser, &index);
+	for (i = 1; i < 256; i++) {
+		int in = TESTBIT(raw, i) || TESTBIT(raw, tolower(i)) ||
+			TESTBIT(raw, toupper(i));
+		if (in != negate)
+			SETBIT(set, i);
+	}
+	return single(parser, NFA_SET, index, fragment);
+}
+/* Backslashes are literal inside of brackets, as POSIX says */
+
+static int parseAtom(Parser *parser, Fragment *fragment) {
+	unsigned char *set;
+	int index;
+	int c;
+	switch (*parser->p) {
+	case '(':
+		if (++parser->depth > MAX_DEPTH)
+			return 1;
+		parser->p++;
+		if (parseAlternation(parser, fragment) || *parser->p != ')')
+			return 1;
+		parser->p++;
+		parser->depth--;
+		return 0;
+	case '[':
+		return parseBracket(parser, fragment);
+	case '.':
+		parser->p++;
+		set = newSet(parser, &index);
+		memset(set, 0xff, sizeof *parser->automaton->sets);
+		set[0] &= ~1;
+		return single(parser, NFA_SET, index, fragment);
+	case '\\':
+		c = (unsigned char) parser->p[1];
+		if (c == '\0' || strchr(METACHARS, c) == NULL)
+			return 1;
+		parser->p += 2;
+		break;
+	case '\0': case ')': case '|': case '^': case '$':
+	case '*': case '+': case '?': case '{':
+		return 1;
+	default:
+		c = (unsigned char) *parser->p++;
+		break;
+	}
+	set = newSet(parser, &index);
+	SETBIT(set, tolower(c));
+	return single(parser, NFA_SET, index, fragment);
+}
+
+static int parseInterval(Parser *parser, const char *atom,
+		Fragment *fragment) {
+	const char *p = parser->p + 1;
+	int min, max, count, i;
+	if (!isdigit((unsigned char) *p) && *p != ',')
+		return 1;
+	for (min = 0; isdigit((unsigned char) *p); p++)
+		if ((min = min * 10 + *p - '0') > NFA_MAX_REPEAT)
+			return 1;
+	max = min;
+	if (*p == ',') {
+		p++;
+		max = isdigit((unsigned char) *p) ? 0 : -1;
+		for (; isdigit((unsigned char) *p); p++)
+			if ((max = max * 10 + *p - '0') > NFA_MAX_REPEAT)
+				return 1;
+	}
+	if (*p != '}' || (max >= 0 && max < min) || isQuantifier(p[1]))
+		return 1;
+
+	count = max < 0 ? min + 1 : max;
+	if (empty(parser, fragment))
+		return 1;
+	for (i = 0; i < count; i++) {
+		Fragment copy;
+		parser->p = atom;
+		if (parseAtom(parser, &copy))
+			return 1;
+		if (i >= min && quantify(parser, &copy, max < 0 ? '*' : '?'))
+			return 1;
+		concat(parser, fragment, &copy);
+	}
+	parser->p = p + 1;
+	return 0;
+}
+/* Intervals get expanded into copies of the atom, so they're capped at
+ * NFA_MAX_REPEAT. The atom is parsed again for each copy. */
+
+static int parsePiece(Parser *parser, Fragment *fragment) {
+	const char *atom = parser->p;
+	int quantified = 0;
+	if (parseAtom(parser, fragment))
+		return 1;
+	for (;; quantified = 1) {
+		switch (*parser->p) {
+		case '*': case '+': case '?':
+			if (quantify(parser, fragment, *parser->p++))
+				return 1;
+			break;
+		case '{':
+			if (quantified)
+				return 1;
+			return parseInterval(parser, atom, fragment);
+		default:
+			return 0;
+		}
+	}
+}
+
+static int parseBranch(Parser *parser, Fragment *fragment) {
+	if (parser->depth == 0 && *parser->p == '^')
+		parser->p++;
+	if (empty(parser, fragment))
+		return 1;
+	while (*parser->p != '\0' && *parser->p != '|' && *parser->p != ')') {
+		Fragment piece;
+		if (parser->depth == 0 && parser->p[0] == '$' &&
+				(parser->p[1] == '\0' || parser->p[1] == '|')) {
+			parser->p++;
+			break;
+		}
+		if (parsePiece(parser, &piece))
+			return 1;
+		concat(parser, fragment, &piece);
+	}
+	return 0;
+}
+/* The whole string always has to match, so anchors at the ends of top level
+ * branches don't do anything. Anchors anywhere else aren't supported. */
+
+static int parseAlternation(Parser *parser, Fragment *fragment) {
+	if (parseBranch(parser, fragment))
+		return 1;
+	while (*parser->p == '|') {
+		Fragment other;
+		int split, end;
+		parser->p++;
+		if (parseBranch(parser, &other))
+			return 1;
+		end = newNode(parser, NFA_EPSILON, -1, 0);
+		if (end < 0)
+			return 1;
+		split = newNode(parser, NFA_SPLIT, fragment->start,
+				other.start);
+		if (split < 0)
+			return 1;
+		parser->automaton->nodes[fragment->end].out = end;
+		parser->automaton->nodes[other.end].out = end;
+		fragment->start = split;
+		fragment->end = end;
+	}
+	return 0;
+}
+
+void initAutomaton(Automaton *automaton) {
+	memset(automaton, 0, sizeof *automaton);
+	automaton->start = -1;
+}
+
+int addPattern(Automaton *automaton, const char *regex, int rule) {
+	Parser parser;
+	Fragment fragment;
+	const size_t nodecount = automaton->nodecount;
+	const size_t setcount = automaton->setcount;
+	int match;
+
+	parser.automaton = automaton;
+	parser.p = regex;
+	parser.base = nodecount;
+	parser.depth = 0;
+	if (parseAlternation(&parser, &fragment) || *parser.p != '\0' ||
+			(match = newNode(&parser, NFA_MATCH, -1, rule)) < 0) {
+		automaton->nodecount = nodecount;
+		automaton->setcount = setcount;
+		return 1;
+	}
+	automaton->nodes[fragment.end].out = match;
+
+	if (automaton->startcount >= automaton->startalloc) {
+		automaton->startalloc = automaton->startalloc ?
+			automaton->startalloc * 2 : 16;
+		automaton->starts = xrealloc(automaton->starts,
+			automaton->startalloc * sizeof *automaton->starts);
+	}
+	automaton->starts[automaton->startcount++] = fragment.start;
+	return 0;
+}
+
+void finishAutomaton(Automaton *automaton) {
+	unsigned char next[256];
+	int remap[512];
+	size_t i;
+	int c;
+	if (automaton->startcount == 0)
+		return;
+
+	memset(automaton->classes, 0, sizeof automaton->classes);
+	automaton->classcount = 1;
+	for (i = 0; i < automaton->setcount; i++) {
+		int count = 0;
+		for (c = 0; c < 512; c++)
+			remap[c] = -1;
+		for (c = 0; c < 256; c++) {
+			int key = automaton->classes[c] * 2 +
+				TESTBIT(automaton->sets[i], tolower(c));
+			if (remap[key] < 0)
+				remap[key] = count++;
+			next[c] = remap[key];
+		}
+		memcpy(automaton->classes, next, sizeof next);
+		automaton->classcount = count;
+	}
+	automaton->representatives = xmalloc(automaton->classcount);
+	for (c = 0; c < 256; c++)
+		automaton->representatives[automaton->classes[c]] = tolower(c);
+
+	automaton->states = xmalloc(DFA_MAX_STATES *
+			sizeof *automaton->states);
+	automaton->statecount = 0;
+	automaton->table = xmalloc(DFA_TABLE * sizeof *automaton->table);
+	for (i = 0; i < DFA_TABLE; i++)
+		automaton->table[i] = -1;
+	automaton->start = -1;
+	automaton->stack = xmalloc(automaton->nodecount * sizeof(int));
+	automaton->seeds = xmalloc(automaton->nodecount * sizeof(int));
+	automaton->closure = xmalloc(automaton->nodecount * sizeof(int));
+	automaton->marks = xmalloc(automaton->nodecount *
+			sizeof *automaton->marks);
+	memset(automaton->marks, 0,
+			automaton->nodecount * sizeof *automaton->marks);
+	automaton->generation = 0;
+}
+/*
+ * Splits the bytes into classes that no set tells apart, uppercase letters
+ * always land with their lowercase versions. The DFA then only needs a
+ * transition for each class instead of each byte.
+ * */
+
+static int compareInts(const void *a, const void *b) {
+	const int x = *(const int *) a;
+	const int y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+static size_t closure(Automaton *automaton, const int *seeds, size_t count,
+		int *out) {
+	size_t top, len, i;
+	if (++automaton->generation == 0) {
+		memset(automaton->marks, 0,
+			automaton->nodecount * sizeof *automaton->marks);
+		automaton->generation = 1;
+	}
+#define PUSH(n) do { \
+	if (automaton->marks[n] != automaton->generation) { \
+		automaton->marks[n] = automaton->generation; \
+		automaton->stack[top++] = n; \
+	} \
+} while (0)
+	top = len = 0;
+	for (i = 0; i < count; i++)
+		PUSH(seeds[i]);
+	while (top > 0) {
+		const int index = automaton->stack[--top];
+		const NfaNode *node = automaton->nodes + index;
+		switch (node->type) {
+		case NFA_EPSILON:
+			PUSH(node->out);
+			break;
+		case NFA_SPLIT:
+			PUSH(node->out);
+			PUSH(node->arg);
+			break;
+		case NFA_SET: case NFA_MATCH:
+			out[len++] = index;
+			break;
+		}
+	}
+#undef PUSH
+	qsort(out, len, sizeof *out, compareInts);
+	return len;
+}
+/* Follows the empty transitions from seeds, out gets the nodes that are left
+ * sorted so that equal sets compare equal. */
+
+static void flushStates(Automaton *automaton) {
+	size_t i;
+	for (i = 0; i < automaton->statecount; i++)
+		free(automaton->states[i].nodes);
+	automaton->statecount = 0;
+	for (i = 0; i < DFA_TABLE; i++)
+		automaton->table[i] = -1;
+	automaton->start = -1;
+}
+
+static long findState(Automaton *automaton, size_t len) {
+	const int *nodes = automaton->closure;
+	unsigned long hash = 2166136261UL;
+	size_t i;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ nodes[i]) * 16777619UL;
+	for (i = hash & (DFA_TABLE - 1);; i = (i + 1) & (DFA_TABLE - 1)) {
+		const DfaState *state;
+		if (automaton->table[i] < 0)
+			return -(long) i - 1;
+		state = automaton->states + automaton->table[i];
+		if (state->nodecount == len && memcmp(state->nodes, nodes,
+					len * sizeof *nodes) == 0)
+			return automaton->table[i];
+	}
+}
+/* Returns the state for the nodes in closure, or -1 - the free slot in the
+ * table where it would go */
+
+static int getState(Automaton *automaton, size_t len) {
+	DfaState *state;
+	size_t acceptcount, i;
+	long slot;
+	int *data;
+
+	slot = findState(automaton, len);
+	if (slot >= 0)
+		return slot;
+	if (automaton->statecount >= DFA_MAX_STATES) {
+		flushStates(automaton);
+		slot = findState(automaton, len);
+	}
+
+	for (acceptcount = i = 0; i < len; i++)
+		if (automaton->nodes[automaton->closure[i]].type == NFA_MATCH)
+			acceptcount++;
+	data = malloc((len + acceptcount + automaton->classcount) *
+			sizeof *data);
+	if (data == NULL)
+		return -1;
+	state = automaton->states + automaton->statecount;
+	state->nodes = data;
+	state->nodecount = len;
+	state->accept = data + len;
+	state->acceptcount = 0;
+	state->next = data + len + acceptcount;
+	for (i = 0; i < len; i++) {
+		const NfaNode *node = automaton->nodes + automaton->closure[i];
+		state->nodes[i] = automaton->closure[i];
+		if (node->type == NFA_MATCH)
+			state->accept[state->acceptcount++] = node->arg;
+	}
+	qsort(state->accept, acceptcount, sizeof *state->accept, compareInts);
+	for (i = 0; i < (size_t) automaton->classcount; i++)
+		state->next[i] = -1;
+	automaton->table[-slot - 1] = automaton->statecount;
+	return automaton->statecount++;
+}
+/* Makes the state for the nodes in closure if it doesn't exist yet. Once the
+ * cache is full it's emptied, which sets start to -1 so that callers know not
+ * to hold on to the old states. */
+
+static int step(Automaton *automaton, int current, int class) {
+	const DfaState *state = automaton->states + current;
+	const int c = automaton->representatives[class];
+	size_t count, len, i;
+	int next;
+	for (count = i = 0; i < state->nodecount; i++) {
+		const NfaNode *node = automaton->nodes + state->nodes[i];
+		if (node->type == NFA_SET &&
+				TESTBIT(automaton->sets[node->arg], c))
+			automaton->seeds[count++] = node->out;
+	}
+	len = closure(automaton, automaton->seeds, count, automaton->closure);
+	next = getState(automaton, len);
+	if (next >= 0 && automaton->start >= 0)
+		automaton->states[current].next[class] = next;
+	return next;
+}
+
+int runAutomaton(Automaton *automaton, const char *str,
+		const int **matches, size_t *count) {
+	int current;
+	*count = 0;
+	if (automaton->startcount == 0)
+		return 0;
+	if (automaton->start < 0) {
+		const size_t len = closure(automaton, automaton->starts,
+				automaton->startcount, automaton->closure);
+		current = getState(automaton, len);
+		if (current < 0)
+			return 1;
+		automaton->start = current;
+	}
+	current = automaton->start;
+	for (; *str != '\0'; str++) {
+		const int class = automaton->classes[(unsigned char) *str];
+		int next = automaton->states[current].next[class];
+		if (next < 0 && (next = step(automaton, current, class)) < 0)
+			return 1;
+		current = next;
+		if (automaton->states[current].nodecount == 0)
+			return 0;
+	}
+	*matches = automaton->states[current].accept;
+	*count = automaton->states[current].acceptcount;
+	return 0;
+}
+/* Gives up early once no rule can match anymore */
+
+void freeAutomaton(Automaton *automaton) {
+	if (automaton->states != NULL)
+		flushStates(automaton);
+	free(automaton->nodes);
+	free(automaton->sets);
+	free(automaton->starts);
+	free(automaton->representatives);
+	free(automaton->states);
+	free(automaton->table);
+	free(automaton->stack);
+	free(automaton->seeds);
+	free(automaton->closure);
+	free(automaton->marks);
+	initAutomaton(automaton);
+}
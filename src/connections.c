@@ -21,116 +21,111 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <unistd.h>
+
 #include <swebs/util.h>
+#include <swebs/spill.h>
 #include <swebs/runner.h>
 #include <swebs/sitefile.h>
 #include <swebs/responses.h>
 #include <swebs/connections.h>
+#include <swebs/responseutil.h>
 
 int newConnection(Stream *stream, Connection *ret, int portind) {
-	struct timespec currentTime;
-
 	ret->stream = stream;
-	ret->progress = RECEIVE_REQUEST;
-
-	ret->currLineAlloc = 30;
-	ret->currLineLen = 0;
-	ret->currLine = malloc(ret->currLineAlloc);
-	if (ret->currLine == NULL)
-		return 1;
-
-	ret->allocatedFields = 10;
-	ret->fields = malloc(sizeof(Field) * ret->allocatedFields);
-	if (ret->fields == NULL) {
-		free(ret->currLine);
+	ret->progress = stream->type == TLS ? HANDSHAKE : RECEIVE_REQUEST;
+
+	ret->buffAlloc = 4096;
+	ret->buffLen = 0;
+	ret->lineStart = 0;
+	ret->scanned = 0;
+	ret->buff = malloc(ret->buffAlloc);
+	if (ret->buff == NULL)
 		return 1;
-	}
-	ret->fieldCount = 0;
-
-	ret->allocatedPathFields = 10;
-	ret->pathFields = malloc(ret->allocatedPathFields * sizeof(PathField));
-	if (ret->pathFields == NULL) {
-		free(ret->currLine);
-		free(ret->fields);
+	if (initArena(&ret->arena, ARENA_START)) {
+		free(ret->buff);
 		return 1;
 	}
-	ret->pathFieldCount = 0;
 
+	ret->fields = NULL;
+	ret->fieldCount = ret->allocatedFields = 0;
+	ret->query = NULL;
 	ret->body = NULL;
-	/*
-	 * pointers to things that are allocated within functions should be
-	 * initialized to NULL so that free() doens't fail.
-	 * */
-
-	if (clock_gettime(CLOCK_MONOTONIC, &currentTime) < 0) {
-		free(ret->currLine);
-		free(ret->fields);
-		free(ret->pathFields);
-		return 1;
-	}
-	memcpy(&ret->lastdata, &currentTime, sizeof(struct timespec));
+	/* These all come out of the arena once there's a request */
+	ret->bodyfd = -1;
+	ret->pipes[0] = ret->pipes[1] = -1;
 
 	ret->portind = portind;
+	ret->requests = 0;
+	initQueue(&ret->out);
+	ret->closing = 0;
 	return 0;
 }
 
 void resetConnection(Connection *conn) {
-	long i;
 	conn->progress = RECEIVE_REQUEST;
-	free(conn->body);
+	resetArena(&conn->arena);
 	conn->body = NULL;
-	for (i = 0; i < (long) conn->fieldCount; i++) {
-		free(conn->fields[i].field);
-		free(conn->fields[i].value);
-	}
-	conn->fieldCount = 0;
-	for (i = 0; i < conn->pathFieldCount; i++) {
-		free(conn->pathFields[i].var.data);
-		free(conn->pathFields[i].value.data);
-	}
-	conn->pathFieldCount = 0;
+	if (conn->bodyfd >= 0)
+		close(conn->bodyfd);
+	conn->bodyfd = -1;
+	conn->fields = NULL;
+	conn->fieldCount = conn->allocatedFields = 0;
+	conn->query = NULL;
+	conn->buffLen -= conn->lineStart;
+	memmove(conn->buff, conn->buff + conn->lineStart, conn->buffLen);
+	conn->lineStart = 0;
+	conn->scanned = 0;
+	/* Anything left over is the start of a pipelined request */
 }
 
 void freeConnection(Connection *conn) {
-	long i;
+	freeQueue(&conn->out);
 	freeStream(conn->stream);
-	free(conn->currLine);
-	free(conn->body);
-	for (i = 0; i < (long) conn->fieldCount; i++) {
-		free(conn->fields[i].field);
-		free(conn->fields[i].value);
-	}
-	for (i = 0; i < conn->pathFieldCount; i++) {
-		free(conn->pathFields[i].var.data);
-		free(conn->pathFields[i].value.data);
+	free(conn->buff);
+	freeArena(&conn->arena);
+	if (conn->bodyfd >= 0)
+		close(conn->bodyfd);
+	if (conn->pipes[0] >= 0) {
+		close(conn->pipes[0]);
+		close(conn->pipes[1]);
 	}
-	free(conn->pathFields);
-	free(conn->fields);
 }
 
-static int createBinaryString(BinaryString *ret) {
-	ret->allocatedLen = 50;
-	ret->data = malloc(ret->allocatedLen);
-	if (ret->data == NULL)
-		return 1;
-	ret->len = 0;
-	return 0;
+static char *rebase(char *ptr, char *from, char *to) {
+	return to + (ptr - from);
 }
 
-static int appendBinaryString(BinaryString *ret, char c) {
-	if (ret->len >= ret->allocatedLen) {
-		char *newdata;
-		ret->allocatedLen *= 2;
-		newdata = realloc(ret->data, ret->allocatedLen);
-		if (newdata == NULL) {
-			free(ret->data);
-			return 1;
+static int growBuffer(Connection *conn) {
+	char *newbuff;
+	size_t newalloc;
+	long i;
+	newalloc = conn->buffAlloc * 2;
+	newbuff = malloc(newalloc);
+	if (newbuff == NULL)
+		return 1;
+	memcpy(newbuff, conn->buff, conn->buffLen);
+	if (conn->progress == RECEIVE_HEADER ||
+			conn->progress == RECEIVE_BODY) {
+		char *old = conn->buff;
+		conn->path.data = rebase(conn->path.data, old, newbuff);
+		if (conn->query != NULL)
+			conn->query = rebase(conn->query, old, newbuff);
+		for (i = 0; i < (long) conn->fieldCount; i++) {
+			Field *field = conn->fields + i;
+			field->field = rebase(field->field, old, newbuff);
+			field->value = rebase(field->value, old, newbuff);
 		}
-		ret->data = newdata;
 	}
-	ret->data[ret->len++] = c;
+	free(conn->buff);
+	conn->buff = newbuff;
+	conn->buffAlloc = newalloc;
 	return 0;
 }
+/*
+ * The path and headers point into buff, so they have to be moved along with
+ * it. This only happens for unusually large requests.
+ * */
 
 static int hexval(char c) {
 	if (isdigit(c))
@@ -142,97 +137,164 @@ static int hexval(char c) {
 	return -1;
 }
 
-static int getBinaryString(BinaryString *ret, char *path, char stop,
+static int decodeString(BinaryString *ret, char *str, char stop,
 		long *lenReturn) {
-	long i;
-	createBinaryString(ret);
-	for (i = 0; path[i] != stop && path[i] != '\0'; i++) {
-		char c;
-		if (path[i] == '%') {
-			int v;
-			v = hexval(path[i + 1]);
-			if (v < 0) {
-				free(ret->data);
+	long i, len;
+	len = 0;
+	for (i = 0; str[i] != stop && str[i] != '\0'; i++) {
+		if (str[i] == '%') {
+			int high, low;
+			high = hexval(str[i + 1]);
+			if (high < 0)
 				return 1;
-			}
-			c = v << 4;
-			v = hexval(path[i + 2]);
-			if (v < 0) {
-				free(ret->data);
+			low = hexval(str[i + 2]);
+			if (low < 0)
 				return 1;
-			}
-			c |= v;
+			str[len++] = high << 4 | low;
 			i += 2;
 		}
 		else
-			c = path[i];
-		appendBinaryString(ret, c);
+			str[len++] = str[i];
 	}
-	appendBinaryString(ret, '\0');
 	*lenReturn = i;
+	ret->data = str;
+	ret->len = len;
+	ret->allocatedLen = 0;
 	return 0;
 }
+/*
+ * Decodes str in place, decoding never makes anything longer so the result
+ * can be written over the bytes that have already been read. Until the first
+ * '%' every byte is written back onto itself. The caller has to look at
+ * str[*lenReturn] before terminating the result, which might overwrite it.
+ * */
 
 static int processPath(Connection *conn, char *path) {
 	long len;
-	if (getBinaryString(&conn->path, path, '?', &len))
+	if (decodeString(&conn->path, path, '?', &len))
 		return 1;
-	path += len;
-	while (path[0] != '\0') {
-		if (conn->pathFieldCount >= conn->allocatedPathFields) {
-			PathField *newPathFields;
-
-			conn->allocatedPathFields *= 2;
-			newPathFields = realloc(conn->pathFields,
-						conn->allocatedPathFields *
-						sizeof(PathField));
-			if (newPathFields == NULL)
-				goto error;
-			conn->pathFields = newPathFields;
-		}
-
-		path++;
-		if (getBinaryString(
-				&conn->pathFields[conn->pathFieldCount].var,
-				path, '=', &len))
-			goto error;
-		path += len;
-		if (path[0] == '\0') {
-			free(conn->pathFields[conn->pathFieldCount].var.data);
-			goto error;
-		}
-		path++;
-		if (getBinaryString(
-				&conn->pathFields[conn->pathFieldCount].value,
-				path, '&', &len)) {
-			free(conn->pathFields[conn->pathFieldCount].var.data);
-			goto error;
+	conn->query = path[len] == '?' ? path + len + 1 : NULL;
+	conn->path.data[conn->path.len] = '\0';
+	return 0;
+}
+/* The query string is left alone until something asks for it */
+
+static int decodeQuery(Arena *arena, char *str, size_t len,
+		BinaryString *ret) {
+	size_t i;
+	char *data;
+	data = arenaAlloc(arena, len + 1);
+	if (data == NULL)
+		return 1;
+	ret->data = data;
+	ret->len = 0;
+	ret->allocatedLen = 0;
+	for (i = 0; i < len; i++) {
+		if (str[i] == '%') {
+			int high, low;
+			if (i + 2 >= len)
+				return 1;
+			high = hexval(str[i + 1]);
+			low = hexval(str[i + 2]);
+			if (high < 0 || low < 0)
+				return 1;
+			data[ret->len++] = high << 4 | low;
+			i += 2;
 		}
-		conn->pathFieldCount++;
-		path += len;
+		else
+			data[ret->len++] = str[i];
 	}
+	data[ret->len] = '\0';
 	return 0;
-error:
-	{
-		long i;
-		for (i = 0; i < (long) conn->fieldCount; i++) {
-			free(conn->pathFields[i].var.data);
-			free(conn->pathFields[i].value.data);
+}
+
+static int matchQuery(char *str, size_t len, char *name) {
+	size_t i;
+	for (i = 0; i < len; i++, name++) {
+		char c = str[i];
+		if (c == '%') {
+			int high, low;
+			if (i + 2 >= len)
+				return 0;
+			high = hexval(str[i + 1]);
+			low = hexval(str[i + 2]);
+			if (high < 0 || low < 0)
+				return 0;
+			c = high << 4 | low;
+			i += 2;
 		}
-		free(conn->pathFields);
-		free(conn->path.data);
-		return 1;
+		if (*name != c || c == '\0')
+			return 0;
+	}
+	return *name == '\0';
+}
+/* Compares an encoded name without decoding it anywhere */
+
+static char *splitQuery(char *pair, char **end, char **equals) {
+	while (*pair == '&')
+		pair++;
+	if (*pair == '\0')
+		return NULL;
+	*end = pair;
+	*equals = NULL;
+	while (**end != '&' && **end != '\0') {
+		if (**end == '=' && *equals == NULL)
+			*equals = *end;
+		++*end;
+	}
+	if (*equals == NULL)
+		*equals = *end;
+	return pair;
+}
+/* Finds the next var=value pair in a query string, or returns NULL. A var
+ * without a value gets equals set to end. */
+
+static char *queryValue(char *equals, char *end) {
+	return equals == end ? end : equals + 1;
+}
+
+int nextQueryPair(Connection *conn, long *pos, BinaryString *var,
+		BinaryString *value) {
+	char *pair, *end, *equals;
+	if (conn->query == NULL)
+		return 0;
+	pair = splitQuery(conn->query + *pos, &end, &equals);
+	if (pair == NULL)
+		return 0;
+	*pos = end - conn->query;
+	if (decodeQuery(&conn->arena, pair, equals - pair, var))
+		return -1;
+	pair = queryValue(equals, end);
+	return decodeQuery(&conn->arena, pair, end - pair, value) ? -1 : 1;
+}
+
+BinaryString *findQuery(Connection *conn, char *var) {
+	char *pair, *end, *equals;
+	BinaryString *ret;
+	if (conn->query == NULL)
+		return NULL;
+	for (pair = conn->query;
+			(pair = splitQuery(pair, &end, &equals)) != NULL;
+			pair = end) {
+		if (!matchQuery(pair, equals - pair, var))
+			continue;
+		ret = arenaAlloc(&conn->arena, sizeof *ret);
+		if (ret == NULL)
+			return NULL;
+		pair = queryValue(equals, end);
+		if (decodeQuery(&conn->arena, pair, end - pair, ret))
+			return NULL;
+		return ret;
 	}
+	return NULL;
 }
 
-static int processRequest(Connection *conn) {
-	char *line;
+static int processRequest(Connection *conn, char *line) {
 	long i;
 
-	line = conn->currLine;
 	/*
-	 * line is not necessarily always conn->currentLine. It's the beginning
-	 * of the currently parsing thing.
+	 * line is not necessarily always the start of the request line. It's
+	 * the beginning of the currently parsing thing.
 	 * */
 	for (i = 0;; i++) {
 		if (line[i] == ' ') {
@@ -259,159 +321,501 @@ static int processRequest(Connection *conn) {
 			return 1;
 		}
 	}
-	if (strcmp(line, "HTTP/1.0") && strcmp(line, "HTTP/1.1"))
+	conn->http10 = strcmp(line, "HTTP/1.0") == 0;
+	if (!conn->http10 && strcmp(line, "HTTP/1.1"))
 		return 1;
 	conn->progress = RECEIVE_HEADER;
 	conn->fieldCount = 0;
+	for (i = 0; i < HEADER_COUNT; i++)
+		conn->known[i] = -1;
 
 	return 0;
 }
 
-static int processField(Connection *conn) {
-	long i;
-	char *line, *split, *field, *value;
-	size_t linelen;
-	Field *newfields;
-	if (conn->currLineLen == 0) {
-		conn->progress = RECEIVE_BODY;
-		for (i = 0; i < (long) conn->fieldCount; i++) {
-			if (strcmp(conn->fields[i].field,
-			           "Content-Length") == 0) {
-				conn->bodylen = atol(conn->fields[i].value);
-				goto foundlen;
-			}
-		}
-		conn->bodylen = 0;
-		conn->body = NULL;
-		goto lendone;
-foundlen:
-		conn->body = malloc(conn->bodylen);
+static int parseLength(char *str, size_t *ret) {
+	*ret = 0;
+	if (*str == '\0')
+		return 1;
+	for (; *str != '\0'; str++) {
+		if (!isdigit((unsigned char) *str))
+			return 1;
+		if (*ret > MAX_BODY)
+			return 0;
+		/* Too big either way, this just stops it overflowing */
+		*ret = *ret * 10 + (*str - '0');
+	}
+	return 0;
+}
+
+static int parseChunkSize(char *str, size_t *ret) {
+	int digits;
+	*ret = 0;
+	for (digits = 0;; digits++, str++) {
+		int v = hexval(*str);
+		if (v < 0)
+			break;
+		if (*ret > MAX_BODY)
+			return 1;
+		*ret = *ret << 4 | v;
+	}
+	if (digits == 0)
+		return 1;
+	return *str != '\0' && *str != ';' && *str != ' ' && *str != '\t';
+	/* Chunk extensions are ignored */
+}
+
+static int hasToken(char *value, char *token) {
+	for (;;) {
+		size_t i;
+		while (*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+		if (*value == '\0')
+			return 0;
+		for (i = 0; token[i] != '\0' &&
+				tolower((unsigned char) value[i]) == token[i]; i++)
+			;
+		value += i;
+		if (token[i] == '\0' && (*value == '\0' || *value == ',' ||
+					*value == ' ' || *value == '\t'))
+			return 1;
+		while (*value != ',' && *value != '\0')
+			value++;
+	}
+}
+/* Looks for a lowercase token in a comma separated list like Connection's */
+
+static int keepAlive(Connection *conn, Sitefile *site) {
+	const Port *port = site->ports + conn->portind;
+	const long field = conn->known[HEADER_CONNECTION];
+	const int timeout = port->keepalive < 0 ? port->timeout :
+		port->keepalive;
+	char *fields;
+	size_t len;
+
+	conn->requests++;
+	if (field >= 0 && hasToken(conn->fields[field].value, "close"))
+		conn->keepalive = 0;
+	else if (conn->http10)
+		conn->keepalive = field >= 0 &&
+			hasToken(conn->fields[field].value, "keep-alive");
+	else
+		conn->keepalive = 1;
+	if (port->keepalive == 0 || (port->maxrequests > 0 &&
+			conn->requests >= port->maxrequests))
+		conn->keepalive = 0;
+
+	if (!conn->keepalive) {
+		conn->out.connfields = "Connection: close\r\n";
+		return 0;
+	}
+	fields = arenaAlloc(&conn->arena, 100);
+	if (fields == NULL)
+		return 1;
+	len = 0;
+	if (conn->http10)
+		len += sprintf(fields + len, "Connection: keep-alive\r\n");
+	if (timeout >= 1000 || port->maxrequests > 0) {
+		len += sprintf(fields + len, "Keep-Alive: ");
+		if (timeout >= 1000)
+			len += sprintf(fields + len, "timeout=%d%s",
+					timeout / 1000,
+					port->maxrequests > 0 ? ", " : "");
+		if (port->maxrequests > 0)
+			len += sprintf(fields + len, "max=%ld",
+					port->maxrequests - conn->requests);
+		len += sprintf(fields + len, "\r\n");
+	}
+	conn->out.connfields = len > 0 ? fields : NULL;
+	return 0;
+}
+/*
+ * Decides whether the connection stays open after this request and sets the
+ * header lines saying so. The advertised timeout is rounded down so that the
+ * client gives up on the connection before it's closed under it.
+ * */
+
+static int startBody(Connection *conn, Sitefile *site) {
+	long encoding = conn->known[HEADER_TRANSFER_ENCODING];
+	long length = conn->known[HEADER_CONTENT_LENGTH];
+	long expect = conn->known[HEADER_EXPECT];
+	if (keepAlive(conn, site))
+		return 1;
+	conn->progress = RECEIVE_BODY;
+	conn->headEnd = conn->lineStart;
+	conn->body = NULL;
+	conn->bodylen = conn->receivedBody = conn->bodyAlloc = 0;
+	conn->chunked = 0;
+	if (encoding >= 0) {
+		if (istrcmp(conn->fields[encoding].value, "chunked"))
+			return 1;
+		conn->chunked = 1;
+		conn->chunkStep = CHUNK_SIZE;
+	}
+	/* Transfer-Encoding wins over Content-Length */
+	else if (length >= 0 &&
+			parseLength(conn->fields[length].value, &conn->bodylen))
+		return 1;
+
+	if (conn->bodylen > MAX_BODY) {
+		conn->out.connfields = "Connection: close\r\n";
+		sendErrorResponse(&conn->out, ERROR_413);
+		conn->closing = 1;
+		return 0;
+	}
+	if (conn->bodylen > BODY_MEMORY) {
+		conn->bodyfd = createSpill();
+		if (conn->bodyfd < 0)
+			return 1;
+	}
+	else if (conn->bodylen > 0) {
+		conn->body = arenaAlloc(&conn->arena, conn->bodylen);
 		if (conn->body == NULL)
 			return 1;
-lendone:
-		conn->receivedBody = 0;
+		conn->bodyAlloc = conn->bodylen;
+	}
+
+	if (expect >= 0 && (conn->chunked || conn->bodylen > 0) &&
+			istrcmp(conn->fields[expect].value, "100-continue") == 0)
+		return queueBuffer(&conn->out, CONTINUE,
+				sizeof CONTINUE - 1, 1);
+	return 0;
+}
+
+static int storeBody(Connection *conn, char *data, size_t len) {
+	if (len == 0)
 		return 0;
+	if (conn->receivedBody + len > MAX_BODY)
+		return 1;
+	if (conn->bodyfd < 0 && conn->receivedBody + len > conn->bodyAlloc) {
+		size_t need = conn->receivedBody + len;
+		if (need > BODY_MEMORY) {
+			conn->bodyfd = createSpill();
+			if (conn->bodyfd < 0 || writeSpill(conn->bodyfd,
+					conn->body, conn->receivedBody))
+				return 1;
+			conn->body = NULL;
+		}
+		else {
+			char *newbody;
+			size_t newalloc = conn->bodyAlloc ?
+				conn->bodyAlloc : 1024;
+			while (newalloc < need)
+				newalloc *= 2;
+			newbody = arenaRealloc(&conn->arena, conn->body,
+					conn->bodyAlloc, newalloc);
+			if (newbody == NULL)
+				return 1;
+			conn->body = newbody;
+			conn->bodyAlloc = newalloc;
+		}
+	}
+	if (conn->bodyfd >= 0) {
+		if (writeSpill(conn->bodyfd, data, len))
+			return 1;
 	}
+	else
+		memcpy(conn->body + conn->receivedBody, data, len);
+	conn->receivedBody += len;
+	return 0;
+}
+/* Chunked bodies start in memory and move to a file once they get big */
+
+static int processField(Connection *conn, char *line, size_t linelen,
+		Sitefile *site) {
+	char *split;
+	HeaderName name;
+	if (linelen == 0)
+		return startBody(conn, site);
 
 	if (conn->fieldCount >= conn->allocatedFields) {
-		conn->allocatedFields *= 2;
-		newfields = realloc(conn->fields, conn->allocatedFields *
-		                                sizeof(char *[2]));
+		Field *newfields;
+		size_t newalloc = conn->allocatedFields ?
+			conn->allocatedFields * 2 : 16;
+		newfields = arenaRealloc(&conn->arena, conn->fields,
+				conn->allocatedFields * sizeof(Field),
+				newalloc * sizeof(Field));
 		if (newfields == NULL)
 			return 1;
 		conn->fields = newfields;
+		conn->allocatedFields = newalloc;
 	}
 
-	line = conn->currLine;
-	split = strstr(line, ": ");
-	linelen = conn->currLineLen;
+	split = scanChar(line, linelen, ':');
 	if (split == NULL)
 		return 1;
-
-	field = malloc(split - line + 1);
-	if (field == NULL)
-		return 1;
-	memcpy(field, line, split - line);
-	field[split - line] = '\0';
-
-	linelen -= split - line + 2;
-	line += split - line + 2;
-	value = malloc(linelen + 1);
-	if (value == NULL) {
-		free(field);
-		return 1;
-	}
-	memcpy(value, line, linelen + 1);
-
-	conn->fields[conn->fieldCount].field = field;
-	conn->fields[conn->fieldCount].value = value;
-
+	name = getHeaderName(line, split - line);
+	if (name != HEADER_COUNT && conn->known[name] < 0)
+		conn->known[name] = conn->fieldCount;
+	*split++ = '\0';
+	while (*split == ' ' || *split == '\t')
+		split++;
+
+	conn->fields[conn->fieldCount].field = line;
+	conn->fields[conn->fieldCount].value = split;
 	conn->fieldCount++;
 
 	return 0;
 }
+/* Both the name and the value are left where they are in buff */
+
+static int takeLine(Connection *conn, char **line, size_t *linelen) {
+	char *end;
+	end = scanChar(conn->buff + conn->scanned,
+			conn->buffLen - conn->scanned, '\n');
+	if (end == NULL) {
+		conn->scanned = conn->buffLen;
+		return 0;
+	}
+	/* The rest of the line comes in a later read */
+	*line = conn->buff + conn->lineStart;
+	*linelen = end - *line;
+	conn->lineStart = conn->scanned = end - conn->buff + 1;
+	if (*linelen == 0)
+		return -1;
+	if ((*line)[*linelen - 1] == '\r')
+		--*linelen;
+	(*line)[*linelen] = '\0';
+	return 1;
+}
+/* Returns 1 and the next line if there's a whole one in buff, 0 if there isn't
+ * and -1 on error. */
 
-static int processChar(Connection *conn, char c, Sitefile *site) {
-	if (conn->progress < RECEIVE_BODY) {
-		if (conn->currLineLen >= conn->currLineAlloc) {
-			char *newline;
-			conn->currLineAlloc *= 2;
-			newline = realloc(conn->currLine,
-			                        conn->currLineAlloc);
-			if (newline == NULL)
-				return 1;
-			conn->currLine = newline;
+static int processChunks(Connection *conn) {
+	for (;;) {
+		char *line;
+		size_t linelen;
+		int got;
+		if (conn->chunkStep == CHUNK_DATA) {
+			size_t want = conn->chunkLeft;
+			size_t have = conn->buffLen - conn->lineStart;
+			if (want > have)
+				want = have;
+			if (storeBody(conn, conn->buff + conn->lineStart, want))
+				return -1;
+			conn->lineStart = conn->scanned = conn->lineStart + want;
+			conn->chunkLeft -= want;
+			if (conn->chunkLeft > 0)
+				return 0;
+			conn->chunkStep = CHUNK_END;
+			continue;
 		}
-		if (c == '\n') {
-			if (conn->currLineLen == 0)
-				return 1;
-			--conn->currLineLen;
-			if (conn->currLine[conn->currLineLen] != '\r')
-				++conn->currLineLen;
-			conn->currLine[conn->currLineLen] = '\0';
-			if (conn->progress == RECEIVE_REQUEST) {
-				if (processRequest(conn))
+		got = takeLine(conn, &line, &linelen);
+		if (got <= 0)
+			return got;
+		switch (conn->chunkStep) {
+			case CHUNK_SIZE:
+				if (parseChunkSize(line, &conn->chunkLeft))
+					return -1;
+				conn->chunkStep = conn->chunkLeft > 0 ?
+					CHUNK_DATA : CHUNK_TRAILER;
+				break;
+			case CHUNK_END:
+				if (linelen != 0)
+					return -1;
+				conn->chunkStep = CHUNK_SIZE;
+				break;
+			case CHUNK_TRAILER:
+				if (linelen == 0)
+					return 1;
+				break;
+			/* Trailer fields are ignored */
+			default:
+				return -1;
+		}
+	}
+}
+/* Returns 1 once the whole body is in, 0 if more is needed and -1 on error */
+
+static void discardBody(Connection *conn) {
+	size_t left;
+	if (conn->scanned < conn->lineStart)
+		conn->scanned = conn->lineStart;
+	left = conn->buffLen - conn->lineStart;
+	memmove(conn->buff + conn->headEnd, conn->buff + conn->lineStart,
+			left);
+	conn->scanned -= conn->lineStart - conn->headEnd;
+	conn->lineStart = conn->headEnd;
+	conn->buffLen = conn->headEnd + left;
+}
+/* The headers still point into buff, but the body bytes after them have all
+ * been stored elsewhere, so buff only has to hold a partial chunk line. */
+
+static int processLine(Connection *conn, char *line, size_t linelen,
+		Sitefile *site) {
+	if (conn->progress == RECEIVE_REQUEST)
+		return processRequest(conn, line);
+	if (conn->progress == RECEIVE_HEADER)
+		return processField(conn, line, linelen, site);
+	return 0;
+}
+
+static int processData(Connection *conn, Sitefile *site) {
+	while (!conn->closing) {
+		char *line;
+		size_t linelen;
+		int got;
+		if (conn->progress == RECEIVE_BODY) {
+			if (conn->chunked) {
+				got = processChunks(conn);
+				if (got < 0)
 					return 1;
 			}
-			else if (conn->progress == RECEIVE_HEADER) {
-				if (processField(conn))
+			else {
+				size_t want = conn->bodylen -
+					conn->receivedBody;
+				size_t have = conn->buffLen - conn->lineStart;
+				if (want > have)
+					want = have;
+				if (storeBody(conn, conn->buff +
+						conn->lineStart, want))
 					return 1;
+				conn->lineStart += want;
+				got = conn->receivedBody >= conn->bodylen;
+			}
+			if (!got) {
+				discardBody(conn);
+				return 0;
 			}
-			conn->currLineLen = 0;
+			if (conn->chunked)
+				conn->bodylen = conn->receivedBody;
+			if (conn->bodyfd >= 0 &&
+					lseek(conn->bodyfd, 0, SEEK_SET) < 0)
+				return 1;
+			if (sendResponse(conn, site) || !conn->keepalive)
+				conn->closing = 1;
+			/* The last response still has to go out before
+			 * closing */
+			continue;
 		}
-		else
-			conn->currLine[conn->currLineLen++] = c;
-	}
-	else if (conn->progress == RECEIVE_BODY) {
-		if (conn->receivedBody < conn->bodylen)
-			conn->body[conn->receivedBody++] = c;
-	}
-	if (conn->progress == RECEIVE_BODY &&
-	    conn->receivedBody >= conn->bodylen)
-		if (sendResponse(conn, site))
+		got = takeLine(conn, &line, &linelen);
+		if (got < 0)
+			return 1;
+		if (got == 0)
+			return 0;
+		if (processLine(conn, line, linelen, site))
 			return 1;
+	}
 	return 0;
 }
-
-static long diff(struct timespec *t1, struct timespec *t2) {
-/* returns the difference in times in milliseconds */
-	return (t2->tv_sec - t1->tv_sec) * 1000 +
-		(t2->tv_nsec - t1->tv_nsec) / 1000000;
+/*
+ * Works through whatever is in buff. The request line and headers are
+ * parsed where they were received; the path, query and headers end up as
+ * pointers into buff instead of copies. Body bytes that came in along with
+ * the headers get copied out, the rest are received straight into place when
+ * possible.
+ * */
+
+static void parkConnection(Connection *conn) {
+	free(conn->buff);
+	conn->buff = NULL;
+	conn->buffAlloc = 4096;
+	releaseArena(&conn->arena);
+	if (conn->pipes[0] >= 0) {
+		close(conn->pipes[0]);
+		close(conn->pipes[1]);
+		conn->pipes[0] = conn->pipes[1] = -1;
+	}
+}
+/*
+ * Idle keep-alive connections only hold on to their socket. The buffer and
+ * arena come back the next time there's something to read, the arena at the
+ * size it had grown to.
+ * */
+
+int midRequest(Connection *conn) {
+	return conn->progress != RECEIVE_REQUEST || conn->buffLen != 0 ||
+		!queueEmpty(&conn->out);
 }
 
 int updateConnection(Connection *conn, Sitefile *site) {
-	size_t totalReceived = 0;
+	if (conn->progress == HANDSHAKE) {
+		switch (handshakeStream(conn->stream)) {
+			case 0:
+				conn->progress = RECEIVE_REQUEST;
+				break;
+			case 1:
+				return 0;
+			default:
+				return 1;
+		}
+	}
+	/* The client might've sent its request along with the end of the
+	 * handshake, so this goes straight on to reading. */
 	for (;;) {
-		char buff[300];
 		ssize_t received;
-		unsigned long i;
-		struct timespec currentTime;
-		const Port *port = site->ports + conn->portind;
-		if (clock_gettime(CLOCK_MONOTONIC, &currentTime) < 0) {
-			createLog("Error getting current time");
-			return 1;
+		int direct;
+
+		switch (flushQueue(&conn->out, conn->stream)) {
+			case 0:
+				break;
+			case 1:
+				return 0;
+			/* No more requests get read until the client has taken
+			 * the responses it already has. */
+			default:
+				return 1;
 		}
-		if (port->timeout > 0 &&
-		    diff(&conn->lastdata, &currentTime) > port->timeout) {
-			createLog("Connection timed out");
+		if (conn->closing)
 			return 1;
+
+		direct = conn->progress == RECEIVE_BODY && !conn->chunked &&
+			(conn->bodyfd < 0 || conn->stream->type == TCP);
+		/* processData() always leaves buff empty when it stops in
+		 * the middle of a body with a known length, so the rest of it
+		 * can skip buff. */
+		if (direct && conn->bodyfd >= 0) {
+			received = spliceSpill(conn->stream->fd, conn->bodyfd,
+					conn->bodylen - conn->receivedBody,
+					conn->pipes);
+			createFormatLog("Spliced %ld bytes", received);
+		}
+		else if (direct) {
+			received = recvStream(conn->stream,
+					conn->body + conn->receivedBody,
+					conn->bodylen - conn->receivedBody);
+			createFormatLog("Received %ld bytes", received);
+		}
+		else {
+			if (conn->buff == NULL) {
+				conn->buff = malloc(conn->buffAlloc);
+				if (conn->buff == NULL)
+					return 1;
+			}
+			if (conn->buffLen >= conn->buffAlloc &&
+					growBuffer(conn))
+				return 1;
+			received = recvStream(conn->stream,
+					conn->buff + conn->buffLen,
+					conn->buffAlloc - conn->buffLen);
+			createFormatLog("Received %ld bytes", received);
 		}
-		createFormatLog("Attempting to receive %ld bytes", sizeof buff);
-		received = recvStream(conn->stream, buff, sizeof buff);
-		createFormatLog("Received %ld bytes", received);
 		if (received < 0) {
-			if (conn->stream->type == TCP)
-				return errno != EAGAIN && totalReceived <= 0;
-			else
-				return received == GNUTLS_E_INVALID_SESSION;
+			if (conn->stream->type == TCP) {
+				if (errno == EINTR)
+					continue;
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					return 1;
+			}
+			else {
+				if (received == GNUTLS_E_INTERRUPTED)
+					continue;
+				if (received != GNUTLS_E_AGAIN)
+					return 1;
+			}
+			/* No more edges come for a connection that's left open
+			 * after an error, so anything but running out of data
+			 * closes it. */
+			if (!midRequest(conn))
+				parkConnection(conn);
+			return 0;
 		}
 		if (received == 0)
 			return 1;
-		totalReceived += received;
-		memcpy(&conn->lastdata, &currentTime, sizeof(struct timespec));
-		for (i = 0; (long) i < received; i++) {
-			if (processChar(conn, buff[i], site))
-				return 1;
-		}
+		if (direct)
+			conn->receivedBody += received;
+		else
+			conn->buffLen += received;
+		if (processData(conn, site))
+			return 1;
 	}
 }
@@ -0,0 +1,334 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _DEFAULT_SOURCE
+/* MAP_ANONYMOUS */
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <swebs/timer.h>
+#include <swebs/filecache.h>
+
+static unsigned long hashKey(int rule, const char *path, size_t len) {
+	unsigned long hash;
+	size_t i;
+	hash = 2166136261UL ^ rule;
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) path[i]) * 16777619UL;
+	return hash;
+}
+
+static FileCacheEntry *findSet(FileCache *cache, int rule, const char *path,
+		size_t len, unsigned long *hash) {
+	if (cache->entries == NULL) {
+		cache->entries = calloc(FILE_CACHE_SETS * FILE_CACHE_WAYS,
+				sizeof *cache->entries);
+		if (cache->entries == NULL)
+			return NULL;
+	}
+	*hash = hashKey(rule, path, len);
+	return cache->entries +
+		(*hash & (FILE_CACHE_SETS - 1)) * FILE_CACHE_WAYS;
+}
+
+static void dropEntry(FileCacheEntry *entry) {
+	if (entry->used == 0)
+		return;
+	close(entry->fd);
+	entry->used = 0;
+}
+
+static int lockShared(SharedHeader *shared) {
+	return __sync_bool_compare_and_swap(&shared->lock, 0, getpid());
+}
+/* Returns non-zero if the lock was taken, nobody ever waits for it */
+
+static void unlockShared(SharedHeader *shared) {
+	__sync_synchronize();
+	shared->lock = 0;
+}
+
+void initFileCache(FileCache *cache) {
+	cache->entries = NULL;
+	cache->clock = 0;
+	cache->shared = NULL;
+	cache->ring = NULL;
+	cache->budget = FILE_CACHE_MEMORY;
+}
+
+int shareFileCache(FileCache *cache) {
+	void *map;
+	if (cache->budget == 0)
+		return 0;
+	map = mmap(NULL, sizeof *cache->shared + cache->budget,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+			-1, 0);
+	if (map == MAP_FAILED)
+		return 1;
+	cache->shared = map;
+	cache->ring = (char *) map + sizeof *cache->shared;
+	return 0;
+}
+/* The mapping starts out zeroed, which is an empty cache. Pages only get used
+ * once something is written to them. */
+
+void freeFileCache(FileCache *cache) {
+	size_t i;
+	if (cache->entries != NULL)
+		for (i = 0; i < FILE_CACHE_SETS * FILE_CACHE_WAYS; i++)
+			dropEntry(cache->entries + i);
+	free(cache->entries);
+	cache->entries = NULL;
+	if (cache->shared != NULL)
+		munmap(cache->shared, sizeof *cache->shared + cache->budget);
+	cache->shared = NULL;
+}
+
+void recoverFileCache(FileCache *cache, pid_t pid) {
+	SharedHeader *shared = cache->shared;
+	size_t i;
+	if (shared == NULL || shared->lock != pid)
+		return;
+	for (i = 0; i < SHARED_CACHE_SETS * SHARED_CACHE_WAYS; i++) {
+		SharedSlot *slot = shared->slots + i;
+		if ((slot->generation & 1) == 0)
+			continue;
+		slot->len = 0;
+		__sync_synchronize();
+		slot->generation++;
+	}
+	unlockShared(shared);
+}
+/* The ring head is always moved before anything is written, so responses
+ * that were partly written over are already known to be gone */
+
+FileCacheEntry *findFile(FileCache *cache, int rule, const char *path) {
+	FileCacheEntry *set;
+	unsigned long hash;
+	size_t len, i;
+	len = strlen(path);
+	if (len > FILE_CACHE_KEY)
+		return NULL;
+	set = findSet(cache, rule, path, len, &hash);
+	if (set == NULL)
+		return NULL;
+	for (i = 0; i < FILE_CACHE_WAYS; i++) {
+		FileCacheEntry *entry = set + i;
+		if (entry->used == 0 || entry->hash != hash ||
+				entry->rule != rule || entry->keylen != len ||
+				memcmp(entry->key, path, len) != 0)
+			continue;
+		if (currentTime() - entry->opened > FILE_CACHE_TTL) {
+			dropEntry(entry);
+			return NULL;
+		}
+		entry->used = ++cache->clock;
+		return entry;
+	}
+	return NULL;
+}
+
+FileCacheEntry *cacheFile(FileCache *cache, int rule, const char *path,
+		int fd) {
+	FileCacheEntry *set, *victim;
+	unsigned long hash;
+	size_t len, i;
+	len = strlen(path);
+	if (len > FILE_CACHE_KEY)
+		return NULL;
+	set = findSet(cache, rule, path, len, &hash);
+	if (set == NULL)
+		return NULL;
+	victim = set;
+	for (i = 0; i < FILE_CACHE_WAYS; i++)
+		if (set[i].used < victim->used)
+			victim = set + i;
+	dropEntry(victim);
+	victim->fd = dup(fd);
+	if (victim->fd < 0)
+		return NULL;
+	victim->hash = hash;
+	victim->used = ++cache->clock;
+	victim->opened = currentTime();
+	victim->rule = rule;
+	victim->keylen = len;
+	memcpy(victim->key, path, len);
+	return victim;
+}
+/* Only called after findFile() missed, so path can't already be in the set */
+
+static int liveSlot(FileCache *cache, const SharedSlot *slot) {
+	return slot->len != 0 &&
+		cache->shared->head - slot->start <= cache->budget;
+}
+/* Only for workers holding the lock */
+
+static long lastUse(FileCache *cache, const SharedSlot *slot) {
+	return liveSlot(cache, slot) ? slot->used : LONG_MIN;
+}
+
+static unsigned long placeResponse(FileCache *cache, size_t len) {
+	unsigned long start;
+	start = cache->shared->head;
+	if (start % cache->budget + len > cache->budget)
+		start += cache->budget - start % cache->budget;
+	return start;
+}
+/* Responses don't wrap around the end of the ring */
+
+static void moveResponse(FileCache *cache, const SharedHit *hit) {
+	SharedHeader *shared = cache->shared;
+	SharedSlot *slot = hit->slot;
+	unsigned long start;
+	if (!lockShared(shared))
+		return;
+	if (slot->generation == hit->generation && liveSlot(cache, slot)) {
+		start = placeResponse(cache, hit->len);
+		slot->generation++;
+		__sync_synchronize();
+		shared->head = start + hit->len;
+		__sync_synchronize();
+		memmove(cache->ring + start % cache->budget,
+				cache->ring + hit->start % cache->budget,
+				hit->len);
+		slot->start = start;
+		__sync_synchronize();
+		slot->generation++;
+	}
+	unlockShared(shared);
+}
+/* Nothing else writes to the ring while the lock is held, so the response is
+ * still there even if moving the head has marked it as written over */
+
+const char *findResponse(FileCache *cache, int rule, const char *path,
+		SharedHit *hit) {
+	SharedSlot *set;
+	unsigned long hash;
+	size_t keylen, i;
+	if (cache->shared == NULL)
+		return NULL;
+	keylen = strlen(path);
+	if (keylen > FILE_CACHE_KEY)
+		return NULL;
+	hash = hashKey(rule, path, keylen);
+	set = cache->shared->slots +
+		(hash & (SHARED_CACHE_SETS - 1)) * SHARED_CACHE_WAYS;
+	for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+		SharedSlot *slot = set + i;
+		long opened;
+		hit->generation = slot->generation;
+		__sync_synchronize();
+		if (hit->generation & 1 || slot->len == 0 ||
+				slot->hash != hash || slot->rule != rule ||
+				slot->keylen != keylen ||
+				memcmp(slot->key, path, keylen) != 0)
+			continue;
+		opened = slot->opened;
+		hit->start = slot->start;
+		hit->len = slot->len;
+		hit->split = slot->split;
+		__sync_synchronize();
+		if (slot->generation != hit->generation)
+			return NULL;
+		if (currentTime() - opened > FILE_CACHE_TTL ||
+				cache->shared->head - hit->start >
+				cache->budget)
+			return NULL;
+		hit->slot = slot;
+		return cache->ring + hit->start % cache->budget;
+	}
+	return NULL;
+}
+/* Everything is read before the generation is checked again, so what's
+ * returned all comes from one version of the slot */
+
+int finishResponse(FileCache *cache, const SharedHit *hit) {
+	unsigned long age;
+	long now;
+	__sync_synchronize();
+	age = cache->shared->head - hit->start;
+	if (age > cache->budget)
+		return 1;
+	now = currentTime();
+	if (hit->slot->generation == hit->generation && hit->slot->used != now)
+		hit->slot->used = now;
+	/* Skipping the write when it wouldn't change anything keeps the
+	 * workers from fighting over the cache line */
+	if (age > cache->budget - cache->budget / 4)
+		moveResponse(cache, hit);
+	return 0;
+}
+
+int keepResponse(FileCache *cache, int rule, const char *path,
+		const char *response, size_t len, size_t split) {
+	SharedHeader *shared = cache->shared;
+	SharedSlot *set, *victim;
+	unsigned long hash, start;
+	size_t keylen, i;
+	if (shared == NULL || len > cache->budget)
+		return 1;
+	keylen = strlen(path);
+	if (keylen > FILE_CACHE_KEY)
+		return 1;
+	if (!lockShared(shared))
+		return 1;
+	hash = hashKey(rule, path, keylen);
+	set = shared->slots +
+		(hash & (SHARED_CACHE_SETS - 1)) * SHARED_CACHE_WAYS;
+	victim = set;
+	for (i = 0; i < SHARED_CACHE_WAYS; i++) {
+		SharedSlot *slot = set + i;
+		if (slot->len != 0 && slot->hash == hash &&
+				slot->rule == rule && slot->keylen == keylen &&
+				memcmp(slot->key, path, keylen) == 0) {
+			victim = slot;
+			break;
+		}
+		if (lastUse(cache, slot) < lastUse(cache, victim))
+			victim = slot;
+	}
+	/* Replaces path if another worker already put it in, otherwise an
+	 * empty slot or the least recently used one */
+
+	start = placeResponse(cache, len);
+
+	victim->generation++;
+	__sync_synchronize();
+	shared->head = start + len;
+	__sync_synchronize();
+	/* Readers of whatever used to be here see the new head before any of
+	 * it is written over */
+	memcpy(cache->ring + start % cache->budget, response, len);
+	victim->hash = hash;
+	victim->opened = currentTime();
+	victim->used = victim->opened;
+	victim->rule = rule;
+	victim->keylen = keylen;
+	memcpy(victim->key, path, keylen);
+	victim->start = start;
+	victim->len = len;
+	victim->split = split;
+	__sync_synchronize();
+	victim->generation++;
+
+	unlockShared(shared);
+	return 0;
+}
@@ -42,7 +42,10 @@ typedef struct {
 
 static Runner *runners;
 static int processes;
-static volatile int *pending;
+static int backlog;
+static int reuseport;
+static BalancePolicy policy;
+static WorkerLoad *loads;
 static Sitefile *site;
 static int mainfd; /* fd of the UNIX socket */
 static struct sockaddr_un addr;
@@ -66,9 +69,11 @@ static void createProcess(int id) {
 	int connfd;
 	int i;
 	socklen_t addrlen;
+	Listener **listeners;
 
 	createLog("Creating a new process");
-	pending[id] = 0;
+	loads[id].connections = 0;
+	loads[id].requests = 0;
 
 	pid = fork();
 	switch (pid) {
@@ -100,11 +105,69 @@ static void createProcess(int id) {
 		exit(EXIT_FAILURE);
 	}
 	close(mainfd);
-	runServer(connfd, site, pending, id);
+
+	listeners = NULL;
+	if (reuseport) {
+		listeners = xmalloc(site->portcount * sizeof *listeners);
+		for (i = 0; i < (int) site->portcount; ++i) {
+			listeners[i] = createListener(site->ports[i].num,
+					backlog, 1);
+			if (listeners[i] == NULL) {
+				createErrorLog("createListener() failed, killing child",
+						errno);
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	/* This has to happen before runServer() drops privileges */
+
+	runServer(connfd, site, listeners, loads, id);
 	createLog("child runServer() finished");
 	exit(EXIT_SUCCESS);
 }
 
+static int lessLoaded(int w1, int w2) {
+/* returns non-zero if w1 is less loaded than w2 */
+	if (loads[w1].connections != loads[w2].connections)
+		return loads[w1].connections < loads[w2].connections;
+	return loads[w1].requests < loads[w2].requests;
+}
+
+static int pickWorker(void) {
+	static int next = 0;
+	const int workers = processes - 1;
+	int i, ret;
+	switch (policy) {
+		case TWO_CHOICES:
+			ret = rand() % workers;
+			i = rand() % workers;
+			return lessLoaded(i, ret) ? i : ret;
+		case ROUND_ROBIN:
+			ret = next;
+			next = (next + 1) % workers;
+			return ret;
+		case LEAST_CONNECTIONS: default:
+			ret = 0;
+			for (i = 1; i < workers; i++)
+				if (lessLoaded(i, ret))
+					ret = i;
+			return ret;
+	}
+}
+
+static void sendBatch(int *fds, int *portinds, int count) {
+	int i, worker;
+	worker = pickWorker();
+	__sync_fetch_and_add(&loads[worker].connections, count);
+	if (sendFds(fds, count, runners[worker].fd,
+				portinds, sizeof *portinds)) {
+		createErrorLog("sendFds() failed", errno);
+		__sync_fetch_and_sub(&loads[worker].connections, count);
+	}
+	for (i = 0; i < count; ++i)
+		close(fds[i]);
+}
+
 static void remakeChild(int signal) {
 	pid_t pid;
 	int i, status;
@@ -114,6 +177,7 @@ static void remakeChild(int signal) {
 	pid = wait(&status);
 	createFormatLog("A child has died, recreating: %s",
 			strsignal(WTERMSIG(status)));
+	recoverFileCache(&site->files, pid);
 	for (i = 0; i < processes - 1; i++) {
 		if (runners[i].pid == pid) {
 			close(runners[i].fd);
@@ -125,39 +189,48 @@ static void remakeChild(int signal) {
 
 int main(int argc, char **argv) {
 	int i;
-	int pendingid;
-	int backlog;
+	int loadsid;
 	Listener **listeners;
 	struct pollfd *pollfds;
 
-	setup(argc, argv, &site, &processes, &backlog);
+	setup(argc, argv, &site, &processes, &backlog, &reuseport, &policy);
 
 	listeners = xmalloc(site->portcount * sizeof *listeners);
 	pollfds = xmalloc(site->portcount * sizeof *pollfds);
 	for (i = 0; i < (int) site->portcount; ++i) {
-		listeners[i] = createListener(site->ports[i].num, backlog);
+		listeners[i] = createListener(site->ports[i].num, backlog,
+				reuseport);
 		if (listeners[i] == NULL) {
 			fprintf(stderr, "Failed to listen on port %hu\n",
 					site->ports[i].num);
 			exit(EXIT_FAILURE);
 		}
+		if (reuseport) {
+			freeListener(listeners[i]);
+			continue;
+		}
+		/* The workers make their own listeners, this one was only to
+		 * check that the port is usable. If the master kept it open
+		 * the kernel would hand it connections that nobody accepts. */
 		pollfds[i].fd = listenerfd(listeners[i]);
 		pollfds[i].events = POLLIN;
 	}
 
-	pendingid = smalloc(sizeof(int) * (processes - 1));
-	if (pendingid < 0) {
+	loadsid = smalloc(sizeof *loads * (processes - 1));
+	if (loadsid < 0) {
 		createErrorLog("smalloc() failed", errno);
 		exit(EXIT_FAILURE);
 	}
-	pending = saddr(pendingid);
-	if (pending == NULL) {
+	loads = saddr(loadsid);
+	if (loads == NULL) {
 		createErrorLog("saddr() failed", errno);
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = 0; i < processes - 1; ++i)
-		pending[i] = 0;
+	for (i = 0; i < processes - 1; ++i) {
+		loads[i].connections = 0;
+		loads[i].requests = 0;
+	}
 
 	mainfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	addr.sun_family = AF_UNIX;
@@ -180,6 +253,11 @@ int main(int argc, char **argv) {
 
 	createLog("swebs started");
 
+	if (reuseport)
+		for (;;)
+			pause();
+	/* The master only has to supervise the workers */
+
 	for (;;) {
 		createLog("poll() started");
 		if (poll(pollfds, site->portcount, -1) < 0) {
@@ -192,17 +270,30 @@ int main(int argc, char **argv) {
 
 		createLog("Accepted stream");
 
-		for (i = 0; i < (int) site->portcount; ++i) {
-			if (pollfds[i].revents & POLLIN) {
-				int j, lowestproc, fd;
-				fd = acceptConnection(listeners[i]);
-				lowestproc = 0;
-				for (j = 0; j < processes - 1; j++)
-					if (pending[j] < pending[lowestproc])
-						lowestproc = j;
-				sendFd(fd, runners[lowestproc].fd, &i, sizeof i);
-				close(fd);
+		{
+			int fds[MAX_FD_BATCH];
+			int portinds[MAX_FD_BATCH];
+			int count;
+
+			count = 0;
+			for (i = 0; i < (int) site->portcount; ++i) {
+				if (!(pollfds[i].revents & POLLIN))
+					continue;
+				for (;;) {
+					int fd;
+					fd = acceptConnection(listeners[i]);
+					if (fd < 0)
+						break;
+					fds[count] = fd;
+					portinds[count] = i;
+					if (++count >= MAX_FD_BATCH) {
+						sendBatch(fds, portinds, count);
+						count = 0;
+					}
+				}
 			}
+			if (count > 0)
+				sendBatch(fds, portinds, count);
 		}
 	}
 }
@@ -0,0 +1,228 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <swebs/util.h>
+#include <swebs/mime.h>
+
+#define ISOWS(c) ((c) == ' ' || (c) == '\t')
+
+static const char *skipSpace(const char *str, const char *end) {
+	while (str < end && ISOWS(*str))
+		str++;
+	return str;
+}
+
+static const char *trimSpace(const char *start, const char *end) {
+	while (end > start && ISOWS(end[-1]))
+		end--;
+	return end;
+}
+
+static int findName(const MimeNames *names, const char *name, size_t len) {
+	size_t i, j;
+	for (i = 0; i < names->count; i++) {
+		const char *stored = names->names[i];
+		for (j = 0; j < len; j++)
+			if (stored[j] != tolower((unsigned char) name[j]))
+				break;
+		if (j == len && stored[len] == '\0')
+			return i;
+	}
+	return MIME_UNKNOWN;
+}
+/* Case insensitive, there are only ever a handful of names */
+
+static int addName(MimeNames *names, const char *name, size_t len) {
+	int id;
+	size_t i;
+	char *copy;
+	id = findName(names, name, len);
+	if (id != MIME_UNKNOWN)
+		return id;
+	if (names->count >= names->alloc) {
+		names->alloc *= 2;
+		names->names = xrealloc(names->names,
+				names->alloc * sizeof *names->names);
+	}
+	copy = xmalloc(len + 1);
+	for (i = 0; i < len; i++)
+		copy[i] = tolower((unsigned char) name[i]);
+	copy[len] = '\0';
+	names->names[names->count] = copy;
+	return names->count++;
+}
+
+static void initNames(MimeNames *names) {
+	names->alloc = 8;
+	names->names = xmalloc(names->alloc * sizeof *names->names);
+	names->names[0] = xstrdup("*");
+	names->count = 1;
+}
+
+static void freeNames(MimeNames *names) {
+	size_t i;
+	for (i = 0; i < names->count; i++)
+		free(names->names[i]);
+	free(names->names);
+}
+
+void initMimeTable(MimeTable *table) {
+	initNames(&table->types);
+	initNames(&table->subtypes);
+}
+
+void freeMimeTable(MimeTable *table) {
+	freeNames(&table->types);
+	freeNames(&table->subtypes);
+}
+
+MimeType internMime(MimeTable *table, const char *contenttype) {
+	MimeType ret;
+	const char *start, *end, *slash;
+	ret.type = ret.subtype = MIME_UNKNOWN;
+	for (start = contenttype;; start = end + 1) {
+		end = strchr(start, ';');
+		if (end == NULL)
+			end = start + strlen(start);
+		start = skipSpace(start, end);
+		if (strncmp(start, "charset=", 8) != 0 &&
+				strncmp(start, "boundary=", 9) != 0)
+			break;
+		if (*end == '\0')
+			return ret;
+	}
+	end = trimSpace(start, end);
+	slash = memchr(start, '/', end - start);
+	if (slash == NULL)
+		slash = end;
+	ret.type = addName(&table->types, start, slash - start);
+	if (slash < end)
+		slash++;
+	ret.subtype = addName(&table->subtypes, slash, end - slash);
+	return ret;
+}
+
+static int parseQ(const char *str) {
+	int q, scale;
+	if (!isdigit((unsigned char) *str))
+		return ACCEPT_MAX_Q;
+	q = (*str++ - '0') * ACCEPT_MAX_Q;
+	if (*str == '.')
+		for (str++, scale = ACCEPT_MAX_Q / 10;
+				scale > 0 && isdigit((unsigned char) *str);
+				str++, scale /= 10)
+			q += (*str - '0') * scale;
+	return q > ACCEPT_MAX_Q ? ACCEPT_MAX_Q : q;
+}
+/* Anything that isn't a number counts as 1 */
+
+static int rangeQuality(const char *params, const char *end) {
+	while (params < end) {
+		const char *next;
+		next = memchr(params + 1, ';', end - params - 1);
+		if (next == NULL)
+			next = end;
+		params = skipSpace(params + 1, next);
+		if (next - params >= 2 && tolower((unsigned char) params[0]) ==
+				'q' && params[1] == '=')
+			return parseQ(params + 2);
+		params = next;
+	}
+	return ACCEPT_MAX_Q;
+}
+/* params points at the ; after the media range, or at end if there isn't one */
+
+void parseAccept(const MimeTable *table, const char *accept,
+		AcceptList *ret) {
+	const char *start, *end, *next, *slash, *params;
+	int seen;
+	seen = 0;
+	ret->count = 0;
+	for (start = accept;; start = next + 1) {
+		AcceptRange range;
+		next = strchr(start, ',');
+		if (next == NULL)
+			next = start + strlen(start);
+		params = memchr(start, ';', next - start);
+		if (params == NULL)
+			params = next;
+		start = skipSpace(start, params);
+		end = trimSpace(start, params);
+		if (start < end) {
+			seen = 1;
+			slash = memchr(start, '/', end - start);
+			if (slash == NULL)
+				slash = end;
+			range.range.type = findName(&table->types,
+					start, slash - start);
+			if (slash < end)
+				slash++;
+			range.range.subtype = findName(&table->subtypes,
+					slash, end - slash);
+			if (range.range.type != MIME_UNKNOWN &&
+					range.range.subtype != MIME_UNKNOWN) {
+				if (ret->count == ACCEPT_MAX_RANGES) {
+					seen = 0;
+					break;
+				}
+				range.q = rangeQuality(params, next);
+				ret->ranges[ret->count++] = range;
+			}
+		}
+		if (*next == '\0')
+			break;
+	}
+	/* Headers with too many ranges accept everything, since keeping only
+	 * some of them could lose a wildcard near the end */
+	if (!seen) {
+		ret->ranges[0].range.type = MIME_ANY;
+		ret->ranges[0].range.subtype = MIME_ANY;
+		ret->ranges[0].q = ACCEPT_MAX_Q;
+		ret->count = 1;
+	}
+}
+/* Ranges that can't match any rule are dropped here */
+
+int acceptQuality(const AcceptList *accept, MimeType mime) {
+	size_t i;
+	int q, best;
+	q = 0;
+	best = -1;
+	if (mime.type == MIME_UNKNOWN)
+		return 0;
+	for (i = 0; i < accept->count; i++) {
+		const AcceptRange *range = accept->ranges + i;
+		int specific;
+		if (range->range.type != MIME_ANY &&
+				range->range.type != mime.type)
+			continue;
+		if (range->range.subtype != MIME_ANY &&
+				range->range.subtype != mime.subtype)
+			continue;
+		specific = (range->range.type != MIME_ANY) +
+				(range->range.subtype != MIME_ANY);
+		if (specific > best || (specific == best && range->q > q)) {
+			best = specific;
+			q = range->q;
+		}
+	}
+	return q;
+}
@@ -0,0 +1,376 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include <swebs/util.h>
+#include <swebs/config.h>
+#include <swebs/outqueue.h>
+#include <swebs/zerocopy.h>
+
+#define MAX_IOV 64
+#define CHUNK_HEAD (sizeof(long) * 2 + 2)
+/* room for the chunk length and \r\n in front of pipe chunks */
+
+static OutItem *newItem(OutQueue *queue, OutType type) {
+	OutItem *ret;
+	ret = malloc(sizeof *ret);
+	if (ret == NULL)
+		return NULL;
+	ret->type = type;
+	ret->copy = OUT_READ;
+	ret->data = NULL;
+	ret->len = ret->sent = ret->alloc = 0;
+	ret->fd = -1;
+	ret->left = 0;
+	ret->offset = -1;
+	ret->next = NULL;
+	if (queue->tail == NULL)
+		queue->head = ret;
+	else
+		queue->tail->next = ret;
+	queue->tail = ret;
+	return ret;
+}
+
+static void popItem(OutQueue *queue) {
+	OutItem *item = queue->head;
+	queue->head = item->next;
+	if (queue->head == NULL)
+		queue->tail = NULL;
+	if (item->fd >= 0)
+		close(item->fd);
+	free(item->data);
+	free(item);
+}
+
+void initQueue(OutQueue *queue) {
+	queue->head = queue->tail = NULL;
+	queue->connfields = NULL;
+}
+
+void freeQueue(OutQueue *queue) {
+	while (queue->head != NULL)
+		popItem(queue);
+}
+
+char *queueSpace(OutQueue *queue, size_t len) {
+	OutItem *item = queue->tail;
+	char *ret;
+	if (item == NULL || item->type != OUT_BUFFER ||
+			item->alloc - item->len < len) {
+		size_t alloc = len < OUT_COALESCE ? OUT_COALESCE : len;
+		char *data;
+		data = malloc(alloc);
+		if (data == NULL)
+			return NULL;
+		item = newItem(queue, OUT_BUFFER);
+		if (item == NULL) {
+			free(data);
+			return NULL;
+		}
+		item->data = data;
+		item->alloc = alloc;
+	}
+	ret = item->data + item->len;
+	item->len += len;
+	return ret;
+}
+/* Nothing new gets queued while a TLS record is waiting to be resent, so
+ * growing the last buffer can't change what that record has to contain. */
+
+void unqueueSpace(OutQueue *queue, size_t len) {
+	queue->tail->len -= len;
+}
+
+int queueBuffer(OutQueue *queue, void *data, size_t len, int copy) {
+	OutItem *item;
+	if (copy) {
+		char *space;
+		space = queueSpace(queue, len);
+		if (space == NULL)
+			return 1;
+		memcpy(space, data, len);
+		return 0;
+	}
+	item = newItem(queue, OUT_BUFFER);
+	if (item == NULL) {
+		free(data);
+		return 1;
+	}
+	item->data = data;
+	item->len = item->alloc = len;
+	return 0;
+}
+
+int queueFile(OutQueue *queue, int fd, off_t offset, size_t len) {
+	OutItem *item;
+	if (len < OUT_COALESCE) {
+		char *space;
+		size_t got;
+		space = queueSpace(queue, len);
+		if (space == NULL) {
+			close(fd);
+			return 1;
+		}
+		for (got = 0; got < len;) {
+			ssize_t add;
+			if (offset < 0)
+				add = read(fd, space + got, len - got);
+			else
+				add = pread(fd, space + got, len - got,
+						offset + got);
+			if (add <= 0) {
+				close(fd);
+				return 1;
+			}
+			got += add;
+		}
+		close(fd);
+		return 0;
+	}
+	item = newItem(queue, OUT_FILE);
+	if (item == NULL) {
+		close(fd);
+		return 1;
+	}
+	item->fd = fd;
+	item->left = len;
+	item->offset = offset;
+#if USE_ZEROCOPY
+	{
+		struct stat statbuf;
+		if (fstat(fd, &statbuf) == 0) {
+			if (S_ISREG(statbuf.st_mode))
+				item->copy = OUT_SENDFILE;
+			else if (S_ISFIFO(statbuf.st_mode) &&
+					!(fcntl(fd, F_GETFL) & O_NONBLOCK))
+				item->copy = OUT_SPLICE;
+		}
+	}
+	/* An empty non blocking pipe would look like a full socket to
+	 * splice(), so those get read in. */
+#endif
+	return 0;
+}
+
+int queuePipe(OutQueue *queue, int fd) {
+	OutItem *item;
+	item = newItem(queue, OUT_PIPE);
+	if (item == NULL) {
+		close(fd);
+		return 1;
+	}
+	item->fd = fd;
+	return 0;
+}
+
+int queueEmpty(OutQueue *queue) {
+	return queue->head == NULL;
+}
+
+static int lastChunk(OutItem *item) {
+/* returns non-zero if nothing comes after what's in item->data */
+	switch (item->type) {
+		case OUT_FILE:
+			return item->left == 0;
+		case OUT_PIPE:
+			return item->fd < 0;
+		default:
+			return 1;
+	}
+}
+
+static int itemDone(OutItem *item) {
+	return item->sent >= item->len && lastChunk(item);
+}
+
+static int refill(OutItem *item) {
+/* Reads the next chunk of a file or pipe once the last one has been sent.
+ * Returns non-zero on error. */
+	ssize_t got;
+	if (item->type == OUT_BUFFER || item->sent < item->len ||
+			itemDone(item))
+		return 0;
+	if (item->data == NULL) {
+		item->data = malloc(OUT_CHUNK + CHUNK_HEAD + 2);
+		if (item->data == NULL)
+			return 1;
+	}
+	item->len = item->sent = 0;
+	if (item->type == OUT_FILE) {
+		size_t len;
+		len = item->left < OUT_CHUNK ? item->left : OUT_CHUNK;
+		if (item->offset < 0)
+			got = read(item->fd, item->data, len);
+		else
+			got = pread(item->fd, item->data, len, item->offset);
+		if (got <= 0)
+			return 1;
+		if (item->offset >= 0)
+			item->offset += got;
+		/* The length has already been sent, so a file that got shorter
+		 * can't be recovered from. */
+		item->len = got;
+		item->left -= got;
+		return 0;
+	}
+	got = read(item->fd, item->data + CHUNK_HEAD, OUT_CHUNK);
+	if (got < 0)
+		return 1;
+	if (got == 0) {
+		close(item->fd);
+		item->fd = -1;
+		memcpy(item->data, "0\r\n\r\n", 5);
+		item->len = 5;
+		return 0;
+	}
+	{
+		char head[CHUNK_HEAD + 1];
+		size_t headlen;
+		sprintf(head, "%lx\r\n", (unsigned long) got);
+		headlen = strlen(head);
+		item->sent = CHUNK_HEAD - headlen;
+		memcpy(item->data + item->sent, head, headlen);
+		memcpy(item->data + CHUNK_HEAD + got, "\r\n", 2);
+		item->len = CHUNK_HEAD + got + 2;
+	}
+	return 0;
+}
+
+static int zerocopy(OutItem *item, Stream *stream) {
+	return item->copy != OUT_READ &&
+		(stream->type == TCP || stream->ktls) &&
+		item->sent >= item->len;
+}
+/* Whether what's left of item can go straight from its fd to the socket */
+
+static int sendZerocopy(OutItem *item, int sock) {
+	ssize_t sent;
+	size_t len;
+	len = item->left < OUT_ZEROCOPY ? item->left : OUT_ZEROCOPY;
+	if (item->copy == OUT_SENDFILE)
+		sent = sendFileZerocopy(sock, item->fd,
+				item->offset < 0 ? NULL : &item->offset, len);
+	else
+		sent = sendPipeZerocopy(sock, item->fd, len);
+	if (sent < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 1;
+		if (errno == EINTR)
+			return 0;
+		if (errno == EINVAL || errno == ENOSYS) {
+			item->copy = OUT_READ;
+			return 0;
+		}
+		return -1;
+	}
+	if (sent == 0)
+		return -1;
+	/* Same as in refill(), a file that got shorter is an error */
+	item->left -= sent;
+	return 0;
+}
+/* Returns the same thing as flushQueue(), nothing has been sent when this
+ * fails so the fd can still be read from instead. */
+
+int flushQueue(OutQueue *queue, Stream *stream) {
+	while (queue->head != NULL) {
+		struct iovec iov[MAX_IOV];
+		int iovcnt;
+		OutItem *item;
+		ssize_t sent;
+
+		if (zerocopy(queue->head, stream)) {
+			switch (sendZerocopy(queue->head, stream->fd)) {
+				case 0:
+					break;
+				case 1:
+					return 1;
+				default:
+					return -1;
+			}
+			while (queue->head != NULL && itemDone(queue->head))
+				popItem(queue);
+			continue;
+		}
+
+		iovcnt = 0;
+		for (item = queue->head; item != NULL && iovcnt < MAX_IOV;
+				item = item->next) {
+			if (zerocopy(item, stream))
+				break;
+			/* Waits until everything in front of it is sent */
+			if (refill(item))
+				return -1;
+			if (item->sent < item->len) {
+				iov[iovcnt].iov_base = item->data + item->sent;
+				iov[iovcnt].iov_len = item->len - item->sent;
+				++iovcnt;
+			}
+			if (!lastChunk(item))
+				break;
+			/* Everything after a file or pipe has to wait until
+			 * all of it has been read */
+		}
+
+		if (iovcnt == 0) {
+			while (queue->head != NULL && itemDone(queue->head))
+				popItem(queue);
+			continue;
+		}
+
+		sent = sendStreamv(stream, iov, iovcnt);
+		if (sent < 0) {
+			if (stream->type == TCP) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					return 1;
+				if (errno == EINTR)
+					continue;
+			}
+			else {
+				if (sent == GNUTLS_E_AGAIN)
+					return 1;
+				if (sent == GNUTLS_E_INTERRUPTED)
+					continue;
+			}
+			return -1;
+		}
+
+		for (item = queue->head; item != NULL && sent > 0;
+				item = item->next) {
+			size_t left = item->len - item->sent;
+			if ((size_t) sent < left) {
+				item->sent += sent;
+				break;
+			}
+			item->sent = item->len;
+			sent -= left;
+		}
+		while (queue->head != NULL && itemDone(queue->head))
+			popItem(queue);
+	}
+	return 0;
+}
@@ -34,14 +34,77 @@
 
 static const char *contenttemplate = "Content-Type: %s\r\n";
 
-static int readResponse(Connection *conn, SiteCommand *command) {
+static int closingError(Connection *conn, const char *error) {
+	conn->out.connfields = "Connection: close\r\n";
+	sendErrorResponse(&conn->out, error);
+	return 1;
+}
+/* For errors that end the connection, returns 1 so that it gets closed */
+
+static char *prebuildResponse(int fd, size_t size, SiteCommand *command,
+		size_t *len, size_t *split) {
+	char body[FILE_CACHE_BODY];
+	char *contenthead, *response;
+	size_t got;
+	for (got = 0; got < size;) {
+		ssize_t add;
+		add = pread(fd, body + got, size - got, got);
+		if (add <= 0)
+			return NULL;
+		got += add;
+	}
+	contenthead = malloc(snprintf(NULL, 0, contenttemplate,
+				command->contenttype) + 1);
+	if (contenthead == NULL)
+		return NULL;
+	sprintf(contenthead, contenttemplate, command->contenttype);
+	response = buildResponse(CODE_200, body, got, len, split,
+			contenthead, NULL);
+	free(contenthead);
+	return response;
+}
+/* Returns NULL if the file has to be sent the normal way */
+
+static int readResponse(Connection *conn, Sitefile *site, int rule) {
+	SiteCommand *command = site->content + rule;
+	FileCacheEntry *cached;
 	int fd = -1;
 	struct stat statbuf;
 	char *path;
+	char *key = "";
+	const char *response;
+	SharedHit hit;
+	size_t len, split;
 	path = command->arg;
+	response = findResponse(&site->files, rule, "", &hit);
+	if (response == NULL)
+		response = findResponse(&site->files, rule, conn->path.data,
+				&hit);
+	/* Rules that point at a single file are cached under "", paths
+	 * always start with a / */
+	if (response != NULL) {
+		if (sendPrebuilt(&conn->out, response, hit.len, hit.split))
+			return 1;
+		if (!finishResponse(&site->files, &hit))
+			return 0;
+		unsendPrebuilt(&conn->out, hit.len);
+	}
+	/* Another worker wrote over it while it was being copied */
+	cached = findFile(&site->files, rule, "");
+	if (cached == NULL)
+		cached = findFile(&site->files, rule, conn->path.data);
+	if (cached != NULL) {
+		fd = dup(cached->fd);
+		if (fd < 0)
+			goto error;
+		if (fstat(fd, &statbuf)) {
+			close(fd);
+			goto error;
+		}
+		goto send;
+	}
 	if (stat(path, &statbuf)) {
-		sendErrorResponse(conn->stream, ERROR_404);
-		return 1;
+		return closingError(conn, ERROR_404);
 	}
 	if (S_ISDIR(statbuf.st_mode)) {
 		size_t reqPathLen = conn->path.len;
@@ -59,8 +122,7 @@ static int readResponse(Connection *conn, SiteCommand *command) {
 		if (realpath(assembledPath, requestPath) == NULL) {
 			if (errno == ENOENT) {
 				free(assembledPath);
-				sendErrorResponse(conn->stream, ERROR_404);
-				return 1;
+				return closingError(conn, ERROR_404);
 			}
 			free(assembledPath);
 			goto error;
@@ -84,40 +146,71 @@ static int readResponse(Connection *conn, SiteCommand *command) {
 
 		if (stat(requestPath, &requestBuff)) {
 			free(assembledPath);
-			sendErrorResponse(conn->stream, ERROR_404);
-			return 1;
+			return closingError(conn, ERROR_404);
 		}
 		if (S_ISDIR(requestBuff.st_mode)) {
 			free(assembledPath);
-			sendErrorResponse(conn->stream, ERROR_400);
-			return 1;
+			return closingError(conn, ERROR_400);
 		}
 
 		fd = open(requestPath, O_RDONLY);
 		free(assembledPath);
+		key = conn->path.data;
 	}
 	else
 		fd = open(path, O_RDONLY);
 	if (fd < 0)
 		goto forbidden;
+	if (fstat(fd, &statbuf)) {
+		close(fd);
+		goto error;
+	}
+	if (S_ISREG(statbuf.st_mode)) {
+		char *built;
+		int ret;
+		cacheFile(&site->files, rule, key, fd);
+		if (statbuf.st_size <= FILE_CACHE_BODY &&
+				(built = prebuildResponse(fd, statbuf.st_size,
+					command, &len, &split)) != NULL) {
+			close(fd);
+			keepResponse(&site->files, rule, key, built, len,
+					split);
+			ret = sendPrebuilt(&conn->out, built, len, split);
+			free(built);
+			return ret;
+		}
+	}
+	else
+		statbuf.st_size = lseek(fd, 0, SEEK_END);
+send:
 	{
 		int ret;
 		char *contenthead, *contenttype;
 		contenttype = command->contenttype;
 		contenthead = malloc(snprintf(NULL, 0, contenttemplate, contenttype) + 1);
-		if (contenthead == NULL)
+		if (contenthead == NULL) {
+			close(fd);
 			return 1;
+		}
 		sprintf(contenthead, contenttemplate, contenttype);
-		ret = sendSeekableFile(conn->stream, CODE_200, fd, contenthead, NULL);
+		ret = sendOpenFile(&conn->out, CODE_200, fd, statbuf.st_size,
+				contenthead, NULL);
 		free(contenthead);
 		return ret;
 	}
 error:
-	sendErrorResponse(conn->stream, ERROR_500);
-	return 1;
+	return closingError(conn, ERROR_500);
 forbidden:
-	sendErrorResponse(conn->stream, ERROR_403);
-	return 1;
+	return closingError(conn, ERROR_403);
+}
+
+static BinaryString *requestGetQuery(Request *request, char *var) {
+	return findQuery(request->internal, var);
+}
+
+static int requestNextQuery(Request *request, long *pos, BinaryString *var,
+		BinaryString *value) {
+	return nextQueryPair(request->internal, pos, var, value);
 }
 
 static int linkedResponse(Connection *conn,
@@ -131,17 +224,23 @@ static int linkedResponse(Connection *conn,
 
 	header = malloc(snprintf(NULL, 0, contenttemplate, contenttype) + 1);
 	if (header == NULL)
-		return sendErrorResponse(conn->stream, ERROR_500);
+		return sendErrorResponse(&conn->out, ERROR_500);
 	sprintf(header, contenttemplate, contenttype);
 
 	request.fieldCount = conn->fieldCount;
 	request.fields = conn->fields;
 	request.path.path = conn->path;
-	request.path.fieldCount = conn->pathFieldCount;
-	request.path.fields = conn->pathFields;
+	request.path.fieldCount = 0;
+	request.path.fields = NULL;
 	request.type = conn->type;
 	request.body = conn->body;
 	request.bodylen = conn->bodylen;
+	memcpy(request.known, conn->known, sizeof request.known);
+	request.bodyfd = conn->bodyfd;
+	request.query = conn->query;
+	request.getQuery = requestGetQuery;
+	request.nextQuery = requestNextQuery;
+	request.internal = conn;
 
 	code = getResponse(&request, &response);
 
@@ -149,18 +248,18 @@ static int linkedResponse(Connection *conn,
 
 	switch (response.type) {
 		case FILE_KNOWN_LENGTH:
-			ret =  sendKnownPipe(conn->stream, getCode(code),
+			ret =  sendKnownPipe(&conn->out, getCode(code),
 					response.response.file.fd,
 					response.response.file.len,
 					header, NULL);
 			break;
 		case FILE_UNKNOWN_LENGTH:
-			ret = sendPipe(conn->stream, getCode(code),
+			ret = sendPipe(&conn->out, getCode(code),
 					response.response.file.fd,
 					header, NULL);
 			break;
 		case BUFFER: case BUFFER_NOFREE:
-			ret = sendBinaryResponse(conn->stream, getCode(code),
+			ret = sendBinaryResponse(&conn->out, getCode(code),
 					response.response.buffer.data,
 					response.response.buffer.len,
 					header, NULL);
@@ -168,7 +267,7 @@ static int linkedResponse(Connection *conn,
 				free(response.response.buffer.data);
 			break;
 		case DEFAULT:
-			ret = sendErrorResponse(conn->stream, getCode(code));
+			ret = sendErrorResponse(&conn->out, getCode(code));
 			break;
 	}
 	free(header);
@@ -182,146 +281,20 @@ static int fullmatch(regex_t *regex, char *str) {
 	return match.rm_so != 0 || match.rm_eo != (int) strlen(str);
 }
 
-static char *nextdirective(char *header) {
-	char *loc;
-	loc = strstr(header, "; ");
-	if (loc == NULL)
-		return NULL;
-	return loc + 2;
-}
-
-static char *gettype(char *request, char **type) {
-	char *typeret;
-	char *ret;
-	{
-		char *next;
-		next = strchr(request, ',');
-		if (next == NULL) {
-			typeret = strdup(request);
-			if (typeret == NULL) {
-				*type = NULL;
-				return NULL;
-			}
-			ret = NULL;
-		}
-		else {
-			size_t biglen;
-			biglen = next - request;
-			typeret = malloc(biglen + 1);
-			if (typeret == NULL) {
-				*type = NULL;
-				return NULL;
-			}
-			memcpy(typeret, request, biglen);
-			typeret[biglen] = '\0';
-			ret = next + 1;
-		}
-	}
-	{
-		char *set;
-		set = strchr(typeret, ';');
-		if (set != NULL)
-			set[0] = '\0';
-	}
-	*type = typeret;
-	return ret;
-}
-
-static int ismatch(char *request, char *type) {
-/* Matches a single MIME type. Note that * /html is valid for request. */
-	int i;
-	if (request[0] == '\0' || type[0] == '\0')
-		return request[0] != type[0];
-
-	if (request[0] == '*' && (request[1] == '/' || request[1] == '\0')) {
-		char *nexttype;
-		nexttype = type;
-		while (nexttype[0] != '/' && nexttype[0] != '\0')
-			++nexttype;
-		if (request[1] != nexttype[0])
-			return 0;
-		if (nexttype[0] == '\0')
-			return 1;
-		return ismatch(request + 2, nexttype + 1);
-	}
-
-	for (i = 0; request[i] == type[i] &&
-			request[i] != '/' && request[i] != '\0'; ++i) ;
-	if (request[i] != type[i])
-		return 0;
-	if (request[i] == '\0')
-		return 1;
-	return ismatch(request + i + 1, type + i + 1);
-}
-
-static int wasasked(char *request, char *type) {
-/* request is the Accept header field and type is the type of the page. */
-	char *mimetype; /* the actual mime type*/
-	char *checkloc;
-	{
-		char *typeptr;
-		mimetype = NULL;
-		typeptr = type;
-		while (mimetype == NULL) {
-			char *next;
-			if (typeptr == NULL)
-				return 0;
-			next = nextdirective(typeptr);
-			if (strncmp(typeptr, "charset=", 8) == 0) {
-				typeptr = next;
-				continue;
-			}
-			if (strncmp(typeptr, "boundary=", 9) == 0) {
-				typeptr = next;
-				continue;
-			}
-			if (next == NULL) {
-				mimetype = strdup(typeptr);
-				if (mimetype == NULL)
-					return 0;
-			}
-			else {
-				size_t mimelen;
-				mimelen = next - typeptr;
-				mimetype = malloc(mimelen + 1);
-				if (mimetype == NULL)
-					return 0;
-				memcpy(mimetype, typeptr, mimelen);
-				mimetype[mimelen] = '\0';
-			}
-		}
-	}
-
-	checkloc = request;
-	while (checkloc != NULL) {
-		char *check;
-		checkloc = gettype(checkloc, &check);
-		if (check == NULL)
-			return 0;
-		if (ismatch(check, mimetype)) {
-			free(check);
-			return 1;
-		}
-		free(check);
-	}
-	return 0;
-}
-
 static int sendCertainResponse(Connection *conn, Sitefile *site, int index) {
 	int ret;
 	ret = 0;
 	switch (site->content[index].command) {
 	case READ:
-		ret = readResponse(conn, site->content + index);
+		ret = readResponse(conn, site, index);
 		break;
 	case THROW:
-		ret = sendErrorResponse(conn->stream, site->content[index].arg);
+		ret = sendErrorResponse(&conn->out, site->content[index].arg);
 		break;
 	case LINKED:
 #if DYNAMIC_LINKED_PAGES
 		if (!site->getResponse) {
-			sendErrorResponse(conn->stream, ERROR_500);
-			ret = 1;
+			ret = closingError(conn, ERROR_500);
 		}
 		else
 			ret = linkedResponse(conn, site->getResponse,
@@ -329,50 +302,72 @@ static int sendCertainResponse(Connection *conn, Sitefile *site, int index) {
 #else
 		/* Unreachable state (if a linked response was in the sitefile,
 		 * the parse would've thrown an error) */
-		ret = sendErrorResponse(conn->stream, ERROR_500);
+		ret = sendErrorResponse(&conn->out, ERROR_500);
 #endif
 		break;
 	default:
-		sendErrorResponse(conn->stream, ERROR_500);
-		return 1;
+		return closingError(conn, ERROR_500);
 	}
 	resetConnection(conn);
 	return ret;
 }
 
-int sendResponse(Connection *conn, Sitefile *site) {
-	char *host = NULL;
-	char *accept = "*/*";
-	int i;
-	for (i = 0; i < (int) conn->fieldCount; i++) {
-		if (strcmp(conn->fields[i].field, "Host") == 0)
-			host = conn->fields[i].value;
-		else if (strcmp(conn->fields[i].field, "Accept") == 0)
-			accept = conn->fields[i].value;
-	}
-	if (host == NULL) {
-		sendErrorResponse(conn->stream, ERROR_400);
-		return 1;
-	}
-	for (i = 0; i < (int) site->size; i++) {
-		if (site->content[i].respondto != conn->type)
-			continue;
-		if (fullmatch(&site->content[i].host, host))
-			continue;
-		if (!wasasked(accept, site->content[i].contenttype))
+static int routeRequest(Connection *conn, Sitefile *site, char *host,
+		char *accept) {
+	RouteIter iter;
+	AcceptList ranges;
+	int i, q, best, bestq;
+	if (findRoutes(&site->routes, conn->portind, conn->type, host,
+			conn->path.data, &iter))
+		return ROUTE_UNKNOWN;
+	parseAccept(&site->mime, accept, &ranges);
+	best = ROUTE_NONE;
+	bestq = 0;
+	while ((i = nextRoute(&iter)) >= 0) {
+		SiteCommand *command = site->content + i;
+		if ((command->recheck & ROUTE_HOST) &&
+				fullmatch(&command->host, host))
 			continue;
-		{
-			int j;
-			const unsigned short currport = site->ports[conn->portind].num;
-			for (j = 0; j < site->content[i].portcount; ++j)
-				if (site->content[i].ports[j] == currport)
-					goto foundport;
+		if ((command->recheck & ROUTE_PATH) &&
+				fullmatch(&command->path, conn->path.data))
 			continue;
+		q = acceptQuality(&ranges, command->mime);
+		if (q > bestq) {
+			best = i;
+			bestq = q;
+			if (q >= ACCEPT_MAX_Q)
+				break;
 		}
-foundport:
-		if (fullmatch(&site->content[i].path, conn->path.data) == 0)
-			return sendCertainResponse(conn, site, i);
 	}
-	sendErrorResponse(conn->stream, ERROR_404);
-	return 1;
+	return best;
+}
+/* Returns the rule to respond with, ROUTE_NONE if there isn't one or
+ * ROUTE_UNKNOWN on error. The rule whose type the client gave the highest
+ * q-value wins, the first one in the sitefile breaks ties. */
+
+int sendResponse(Connection *conn, Sitefile *site) {
+	RouteCacheEntry *cached;
+	char *host;
+	char *accept = "*/*";
+	int rule;
+	if (conn->known[HEADER_ACCEPT] >= 0)
+		accept = conn->fields[conn->known[HEADER_ACCEPT]].value;
+	if (conn->known[HEADER_HOST] < 0) {
+		return closingError(conn, ERROR_400);
+	}
+	host = conn->fields[conn->known[HEADER_HOST]].value;
+	cached = cachedRoute(&site->routes, conn->portind, conn->type, host,
+			conn->path.data, accept);
+	if (cached != NULL && cached->rule != ROUTE_UNKNOWN)
+		rule = cached->rule;
+	else {
+		rule = routeRequest(conn, site, host, accept);
+		if (rule == ROUTE_UNKNOWN)
+			return closingError(conn, ERROR_500);
+		if (cached != NULL)
+			cached->rule = rule;
+	}
+	if (rule == ROUTE_NONE)
+		return closingError(conn, ERROR_404);
+	return sendCertainResponse(conn, site, rule);
 }
@@ -27,78 +27,80 @@
 
 #define CONST_FIELDS "Server: swebs/0.1\r\n"
 
-static int resilientSend(Stream *stream, void *data, size_t len) {
-	char *buffer = (char *) data;
-	size_t left = len;
-
-	while (left) {
-		ssize_t sent;
-
-		sent = sendStream(stream, buffer, left);
-
-		if (sent < 0)
-			return 1;
-		if (sent == 0)
+#define MAX_FIELDS 16
+/* The most extra header lines a response can have */
+
+static int headerParts(const char **parts, size_t *lens, size_t *len,
+		const char *status, const char *connfields, const char *last,
+		va_list ap) {
+	int count, i;
+	parts[0] = "HTTP/1.1 ";
+	parts[1] = status;
+	parts[2] = "\r\n" CONST_FIELDS;
+	count = 3;
+	for (;;) {
+		char *field;
+		field = va_arg(ap, char *);
+		if (field == NULL)
 			break;
-		buffer += sent;
-		left -= sent;
+		if (count >= MAX_FIELDS + 3) {
+			va_end(ap);
+			return -1;
+		}
+		parts[count++] = field;
 	}
-	return left != 0;
-}
-
-static int sendString(Stream *stream, char *s) {
-	return resilientSend(stream, (void *) s, strlen(s));
-}
-
-static int sendStreamValist(Stream *stream, char *format, ...) {
-	va_list ap;
-	int len;
-	char *data;
-	va_start(ap, format);
-	len = vsnprintf(NULL, 0, format, ap);
-	data = malloc(len + 1);
-	if (data == NULL)
-		return 1;
-
 	va_end(ap);
-	va_start(ap, format);
-
-	vsprintf(data, format, ap);
-	if (resilientSend(stream, data, len)) {
-		free(data);
-		return 1;
+	if (connfields != NULL)
+		parts[count++] = connfields;
+	parts[count++] = last;
+
+	*len = 0;
+	for (i = 0; i < count; ++i) {
+		lens[i] = strlen(parts[i]);
+		*len += lens[i];
 	}
-	free(data);
-	return 0;
+	return count;
 }
-
-static int sendHeaderValist(Stream *stream, const char *status, va_list ap) {
-	if (sendStreamValist(stream,
-		"HTTP/1.1 %s\r\n"
-		CONST_FIELDS, status))
-		return 1;
-	for (;;) {
-		char *header;
-		header = va_arg(ap, char *);
-		if (header == NULL)
-			break;
-		if (resilientSend(stream, header, strlen(header)))
-			return 1;
+/* Splits a header block into the strings that make it up, returns how many
+ * there are or -1 on error */
+
+static char *copyParts(char *dest, const char **parts, size_t *lens,
+		int count) {
+	int i;
+	for (i = 0; i < count; ++i) {
+		memcpy(dest, parts[i], lens[i]);
+		dest += lens[i];
 	}
-	va_end(ap);
-	return 0;
+	return dest;
 }
 
-static int sendHeaderKnown(Stream *stream, const char *status, size_t len, va_list ap) {
-	if (sendHeaderValist(stream, status, ap))
+static int queueHeaderValist(OutQueue *out, const char *status,
+		const char *last, va_list ap) {
+/* Writes the whole header block into the queue so that it goes out in one
+ * write, usually along with the body. last is the final header line,
+ * including the blank line. */
+	const char *parts[MAX_FIELDS + 5];
+	size_t lens[MAX_FIELDS + 5];
+	size_t len;
+	int count;
+	char *header;
+
+	count = headerParts(parts, lens, &len, status, out->connfields,
+			last, ap);
+	if (count < 0)
+		return 1;
+	header = queueSpace(out, len);
+	if (header == NULL)
 		return 1;
-	return sendStreamValist(stream, "Content-Length: %lu\r\n\r\n", len);
+	copyParts(header, parts, lens, count);
+	return 0;
 }
 
-static int sendHeaderChunked(Stream *stream, const char *status, va_list ap) {
-	if (sendHeaderValist(stream, status, ap))
-		return 1;
-	return sendString(stream, "Transfer-Encoding: chunked\r\n\r\n");
+static int queueHeaderKnown(OutQueue *out, const char *status, size_t len,
+		va_list ap) {
+	char last[sizeof "Content-Length: \r\n\r\n" + 20];
+	sprintf(last, "Content-Length: %lu\r\n\r\n", (unsigned long) len);
+	return queueHeaderValist(out, status, last, ap);
 }
 
 char *getCode(int code) {
@@ -118,17 +120,20 @@ char *getCode(int code) {
 	}
 }
 
-int sendStringResponse(Stream *stream, const char *status, char *str, ...) {
+static int sendBinaryResponseValist(OutQueue *out, const char *status,
+		void *data, size_t len, va_list ap) {
+	if (queueHeaderKnown(out, status, len, ap))
+		return 1;
+	return queueBuffer(out, data, len, 1);
+}
+
+int sendStringResponse(OutQueue *out, const char *status, char *str, ...) {
 	va_list ap;
-	size_t len;
 	va_start(ap, str);
-	len = strlen(str);
-	if (sendHeaderKnown(stream, status, len, ap))
-		return 1;
-	return resilientSend(stream, str, len);
+	return sendBinaryResponseValist(out, status, str, strlen(str), ap);
 }
 
-int sendErrorResponse(Stream *stream, const char *error) {
+int sendErrorResponse(OutQueue *out, const char *error) {
 	const char *template =
 		"<meta charset=utf-8>"
 		"<h1 text-align=center>"
@@ -140,89 +145,102 @@ int sendErrorResponse(Stream *stream, const char *error) {
 	if (response == NULL)
 		return 1;
 	sprintf(response, template, error);
-	ret = sendStringResponse(stream, error, response,
+	ret = sendStringResponse(out, error, response,
 			"Content-Type: text/html\r\n", NULL);
 	free(response);
 	return ret;
 }
 
-static int sendBinaryResponseValist(Stream *stream, const char *status,
-		void *data, size_t len, va_list ap) {
-	if (sendHeaderKnown(stream, status, len, ap))
+static int sendKnownPipeValist(OutQueue *out, const char *status,
+		int fd, off_t offset, size_t len, va_list ap) {
+	if (queueHeaderKnown(out, status, len, ap)) {
+		close(fd);
 		return 1;
-	return resilientSend(stream, data, len);
+	}
+	return queueFile(out, fd, offset, len);
 }
 
-static int sendKnownPipeValist(Stream *stream, const char *status,
-		int fd, size_t len, va_list ap) {
-	size_t totalSent = 0;
-	int result;
-	sendHeaderKnown(stream, status, len, ap);
-	for (;;) {
-		char buffer[1024];
-		ssize_t inBuffer = read(fd, buffer, sizeof(buffer));
-		if (inBuffer < 0) {
-			result = 1;
-			goto end;
-		}
-		if (inBuffer == 0) {
-			result = totalSent != len;
-			goto end;
-		}
-		if (resilientSend(stream, buffer, inBuffer)) {
-			result = 1;
-			goto end;
-		}
-		totalSent += inBuffer;
-	}
-end:
-	close(fd);
-	return result;
+int sendKnownPipe(OutQueue *out, const char *status, int fd, size_t len, ...) {
+	va_list ap;
+	va_start(ap, len);
+	return sendKnownPipeValist(out, status, fd, -1, len, ap);
 }
 
-int sendKnownPipe(Stream *stream, const char *status, int fd, size_t len, ...) {
+int sendOpenFile(OutQueue *out, const char *status, int fd, size_t len, ...) {
 	va_list ap;
 	va_start(ap, len);
-	return sendKnownPipeValist(stream, status, fd, len, ap);
+	return sendKnownPipeValist(out, status, fd, 0, len, ap);
 }
 
-int sendBinaryResponse(Stream *stream, const char *status,
+int sendBinaryResponse(OutQueue *out, const char *status,
 		void *data, size_t len, ...) {
 	va_list ap;
 	va_start(ap, len);
-	return sendBinaryResponseValist(stream, status, data, len, ap);
+	return sendBinaryResponseValist(out, status, data, len, ap);
+}
+
+char *buildResponse(const char *status, const void *body, size_t len,
+		size_t *total, size_t *split, ...) {
+	const char *parts[MAX_FIELDS + 5];
+	size_t lens[MAX_FIELDS + 5];
+	char last[sizeof "Content-Length: \r\n\r\n" + 20];
+	size_t headlen;
+	int count;
+	char *ret, *end;
+	va_list ap;
+
+	sprintf(last, "Content-Length: %lu\r\n\r\n", (unsigned long) len);
+	va_start(ap, split);
+	count = headerParts(parts, lens, &headlen, status, NULL, last, ap);
+	if (count < 0)
+		return NULL;
+	ret = malloc(headlen + len);
+	if (ret == NULL)
+		return NULL;
+	end = copyParts(ret, parts, lens, count - 1);
+	*split = end - ret;
+	end = copyParts(end, parts + count - 1, lens + count - 1, 1);
+	memcpy(end, body, len);
+	*total = headlen + len;
+	return ret;
+}
+
+int sendPrebuilt(OutQueue *out, const char *response, size_t len,
+		size_t split) {
+	size_t connlen;
+	char *space;
+	connlen = out->connfields == NULL ? 0 : strlen(out->connfields);
+	space = queueSpace(out, len + connlen);
+	if (space == NULL)
+		return 1;
+	memcpy(space, response, split);
+	if (connlen)
+		memcpy(space + split, out->connfields, connlen);
+	memcpy(space + split + connlen, response + split, len - split);
+	return 0;
+}
+
+void unsendPrebuilt(OutQueue *out, size_t len) {
+	size_t connlen;
+	connlen = out->connfields == NULL ? 0 : strlen(out->connfields);
+	unqueueSpace(out, len + connlen);
 }
 
-int sendSeekableFile(Stream *stream, const char *status, int fd, ...) {
+int sendSeekableFile(OutQueue *out, const char *status, int fd, ...) {
 	off_t len;
 	va_list ap;
-	va_start(ap, fd);
 	len = lseek(fd, 0, SEEK_END);
-	lseek(fd, 0, SEEK_SET);
 	va_start(ap, fd);
-	return sendKnownPipeValist(stream, status, fd, len, ap);
+	return sendKnownPipeValist(out, status, fd, 0, len, ap);
 }
 
-int sendPipe(Stream *stream, const char *status, int fd, ...) {
+int sendPipe(OutQueue *out, const char *status, int fd, ...) {
 	va_list ap;
 	va_start(ap, fd);
-	if (sendHeaderChunked(stream, status, ap)) {
+	if (queueHeaderValist(out, status,
+			"Transfer-Encoding: chunked\r\n\r\n", ap)) {
 		close(fd);
 		return 1;
 	}
-
-	for (;;) {
-		ssize_t len;
-		char buff[1024];
-
-		len = read(fd, buff, sizeof buff);
-		if (len <= 0) {
-			break;
-		}
-		sendStreamValist(stream, "%lx\r\n", len);
-		resilientSend(stream, buff, (size_t) len);
-		sendString(stream, "\r\n");
-	}
-	close(fd);
-	return 0;
+	return queuePipe(out, fd);
 }
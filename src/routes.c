@@ -0,0 +1,348 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <swebs/util.h>
+#include <swebs/routes.h>
+
+#define METACHARS ".[]()*+?{}|^$\\"
+
+static unsigned long hashKey(unsigned long hash, const char *key) {
+	if (key == NULL)
+		return (hash ^ 0x100) * 16777619UL;
+	for (; *key != '\0'; key++)
+		hash = (hash ^ tolower((unsigned char) *key)) * 16777619UL;
+	return hash * 16777619UL;
+}
+/* FNV-1a, folding case the same way the sitefile regexes do */
+
+static int keyEqual(const char *stored, const char *key) {
+	if (stored == NULL || key == NULL)
+		return stored == key;
+	for (; *stored != '\0'; stored++, key++)
+		if (*stored != tolower((unsigned char) *key))
+			return 0;
+	return *key == '\0';
+}
+
+static int compareInts(const void *a, const void *b) {
+	const int x = *(const int *) a;
+	const int y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+static RouteEntry *findEntry(const RouteBucket *bucket,
+		const char *host, const char *path) {
+	size_t i;
+	if (bucket->entries == NULL)
+		return NULL;
+	i = hashKey(hashKey(2166136261UL, host), path) & bucket->mask;
+	for (;; i = (i + 1) & bucket->mask) {
+		RouteEntry *entry = bucket->entries + i;
+		if (entry->rules == NULL)
+			return entry;
+		if (keyEqual(entry->host, host) && keyEqual(entry->path, path))
+			return entry;
+	}
+}
+/* Returns the entry for the key, or the empty slot it would go in */
+
+static int growBucket(RouteBucket *bucket) {
+	RouteEntry *old = bucket->entries;
+	const size_t oldmask = bucket->mask;
+	const size_t mask = old == NULL ? 7 : oldmask * 2 + 1;
+	size_t i;
+	bucket->entries = calloc(mask + 1, sizeof *bucket->entries);
+	if (bucket->entries == NULL) {
+		bucket->entries = old;
+		return 1;
+	}
+	bucket->mask = mask;
+	if (old == NULL)
+		return 0;
+	for (i = 0; i <= oldmask; i++)
+		if (old[i].rules != NULL)
+			memcpy(findEntry(bucket, old[i].host, old[i].path),
+					old + i, sizeof *old);
+	free(old);
+	return 0;
+}
+
+int initRoutes(Routes *routes, size_t portcount) {
+	size_t i;
+	routes->portcount = portcount;
+	routes->hosts = NULL;
+	routes->rulecount = 0;
+	routes->cache = NULL;
+	routes->clock = 0;
+	routes->buckets = malloc(portcount * INVALID *
+			sizeof *routes->buckets);
+	if (routes->buckets == NULL)
+		return 1;
+	for (i = 0; i < portcount * INVALID; i++) {
+		routes->buckets[i].entries = NULL;
+		routes->buckets[i].mask = routes->buckets[i].used = 0;
+		initAutomaton(&routes->buckets[i].paths);
+		initAutomaton(&routes->buckets[i].hosts);
+	}
+	return 0;
+}
+/* There's a bucket for every valid RequestType, which are all below INVALID */
+
+void freeRoutes(Routes *routes) {
+	size_t i, j;
+	if (routes->buckets == NULL)
+		return;
+	for (i = 0; i < routes->portcount * INVALID; i++) {
+		RouteBucket *bucket = routes->buckets + i;
+		freeAutomaton(&bucket->paths);
+		freeAutomaton(&bucket->hosts);
+		if (bucket->entries == NULL)
+			continue;
+		for (j = 0; j <= bucket->mask; j++) {
+			free(bucket->entries[j].host);
+			free(bucket->entries[j].path);
+			free(bucket->entries[j].rules);
+		}
+		free(bucket->entries);
+	}
+	free(routes->buckets);
+	routes->buckets = NULL;
+	for (i = 0; i < routes->rulecount; i++)
+		free(routes->hosts[i]);
+	free(routes->hosts);
+	free(routes->cache);
+	routes->cache = NULL;
+}
+
+static char *regexLiteral(const char *regex) {
+	char *ret;
+	size_t i, len;
+	if (regex[0] == '\0')
+		return NULL;
+	ret = xmalloc(strlen(regex) + 1);
+	for (i = len = 0; regex[i] != '\0'; i++) {
+		char c = regex[i];
+		if (c == '\\') {
+			c = regex[++i];
+			if (c == '\0' || strchr(METACHARS, c) == NULL)
+				goto isregex;
+		}
+		else if (strchr(METACHARS, c) != NULL)
+			goto isregex;
+		ret[len++] = tolower((unsigned char) c);
+	}
+	ret[len] = '\0';
+	return ret;
+isregex:
+	free(ret);
+	return NULL;
+}
+/* Returns the lowercase string that regex fully matches, or NULL if it could
+ * match anything else. Escaped metacharacters count as literal, so
+ * example\.com becomes example.com. */
+
+static int addEntry(RouteBucket *bucket, const char *host, const char *path,
+		int rule) {
+	RouteEntry *entry;
+	if ((bucket->used + 1) * 2 > (bucket->entries == NULL ? 0 :
+				bucket->mask + 1) && growBucket(bucket))
+		return 1;
+	entry = findEntry(bucket, host, path);
+	if (entry->rules == NULL) {
+		entry->host = host == NULL ? NULL : xstrdup((char *) host);
+		entry->path = xstrdup((char *) path);
+		entry->count = 0;
+		entry->alloc = 4;
+		entry->rules = xmalloc(entry->alloc * sizeof *entry->rules);
+		bucket->used++;
+	}
+	if (entry->count >= entry->alloc) {
+		entry->alloc *= 2;
+		entry->rules = xrealloc(entry->rules,
+				entry->alloc * sizeof *entry->rules);
+	}
+	entry->rules[entry->count++] = rule;
+	return 0;
+}
+
+int addRoute(Routes *routes, size_t portind, RequestType type,
+		const char *host, const char *path, int rule) {
+	RouteBucket *bucket = routes->buckets + portind * INVALID + type;
+	char *hostliteral = regexLiteral(host);
+	char *pathliteral = regexLiteral(path);
+	int ret = 0;
+
+	if ((size_t) rule >= routes->rulecount) {
+		routes->hosts = xrealloc(routes->hosts,
+				(rule + 1) * sizeof *routes->hosts);
+		while (routes->rulecount <= (size_t) rule)
+			routes->hosts[routes->rulecount++] = NULL;
+		routes->hosts[rule] = hostliteral == NULL ? NULL :
+			xstrdup(hostliteral);
+	}
+
+	if (hostliteral == NULL && addPattern(&bucket->hosts, host, rule)) {
+		addPattern(&bucket->hosts, ".*", rule);
+		ret |= ROUTE_HOST;
+	}
+	if (pathliteral != NULL) {
+		if (addEntry(bucket, hostliteral, pathliteral, rule))
+			ret = -1;
+	}
+	else if (addPattern(&bucket->paths, path, rule)) {
+		addPattern(&bucket->paths, ".*", rule);
+		ret |= ROUTE_PATH;
+	}
+	free(hostliteral);
+	free(pathliteral);
+	return ret;
+}
+
+void finishRoutes(Routes *routes) {
+	size_t i;
+	for (i = 0; i < routes->portcount * INVALID; i++) {
+		finishAutomaton(&routes->buckets[i].paths);
+		finishAutomaton(&routes->buckets[i].hosts);
+	}
+}
+
+int findRoutes(Routes *routes, size_t portind, RequestType type,
+		char *host, char *path, RouteIter *iter) {
+	RouteBucket *bucket;
+	const RouteEntry *entry;
+	int i;
+	for (i = 0; i < 3; i++)
+		iter->left[i] = 0;
+	iter->hostcount = 0;
+	iter->hosts = routes->hosts;
+	iter->host = host;
+	if (portind >= routes->portcount || type >= INVALID)
+		return 0;
+	bucket = routes->buckets + portind * INVALID + type;
+
+	for (i = 0; i < 2; i++) {
+		entry = findEntry(bucket, i == 0 ? host : NULL, path);
+		if (entry == NULL || entry->rules == NULL)
+			continue;
+		iter->lists[i] = entry->rules;
+		iter->left[i] = entry->count;
+	}
+	if (runAutomaton(&bucket->paths, path, iter->lists + 2,
+				iter->left + 2))
+		return 1;
+	if (iter->left[1] + iter->left[2] > 0 && runAutomaton(&bucket->hosts,
+				host, &iter->hostmatches, &iter->hostcount))
+		return 1;
+	return 0;
+}
+/*
+ * There are three places a matching rule can come from: the table with both
+ * the host and path literal, the table with a literal path and a regex host,
+ * and the path automaton.
+ * */
+
+int nextRoute(RouteIter *iter) {
+	for (;;) {
+		int i, best, rule;
+		best = -1;
+		for (i = 0; i < 3; i++) {
+			if (iter->left[i] == 0)
+				continue;
+			if (best < 0 ||
+					iter->lists[i][0] < iter->lists[best][0])
+				best = i;
+		}
+		if (best < 0)
+			return -1;
+		iter->left[best]--;
+		rule = *iter->lists[best]++;
+		if (best == 0)
+			return rule;
+		if (best == 2 && iter->hosts[rule] != NULL) {
+			if (keyEqual(iter->hosts[rule], iter->host))
+				return rule;
+			continue;
+		}
+		if (iter->hostcount > 0 && bsearch(&rule, iter->hostmatches,
+				iter->hostcount, sizeof rule, compareInts))
+			return rule;
+	}
+}
+/* Merges the lists, they're each in sitefile order already */
+
+static size_t appendKey(char *key, size_t len, const char *str) {
+	const size_t add = strlen(str) + 1;
+	if (len + add > ROUTE_CACHE_KEY)
+		return ROUTE_CACHE_KEY + 1;
+	memcpy(key + len, str, add);
+	return len + add;
+}
+
+RouteCacheEntry *cachedRoute(Routes *routes, size_t portind,
+		RequestType type, const char *host, const char *path,
+		const char *accept) {
+	char key[ROUTE_CACHE_KEY];
+	RouteCacheEntry *set, *victim;
+	unsigned long hash;
+	size_t len, i;
+
+	len = appendKey(key, 0, host);
+	if (len <= ROUTE_CACHE_KEY)
+		len = appendKey(key, len, path);
+	if (len <= ROUTE_CACHE_KEY)
+		len = appendKey(key, len, accept);
+	if (len > ROUTE_CACHE_KEY)
+		return NULL;
+	if (routes->cache == NULL) {
+		routes->cache = calloc(ROUTE_CACHE_SETS * ROUTE_CACHE_WAYS,
+				sizeof *routes->cache);
+		if (routes->cache == NULL)
+			return NULL;
+	}
+
+	hash = 2166136261UL ^ (portind * INVALID + type);
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) key[i]) * 16777619UL;
+	set = routes->cache +
+		(hash & (ROUTE_CACHE_SETS - 1)) * ROUTE_CACHE_WAYS;
+	victim = set;
+	for (i = 0; i < ROUTE_CACHE_WAYS; i++) {
+		RouteCacheEntry *entry = set + i;
+		if (entry->keylen == len && entry->hash == hash &&
+				entry->portind == portind &&
+				entry->type == type &&
+				memcmp(entry->key, key, len) == 0) {
+			entry->used = ++routes->clock;
+			return entry;
+		}
+		if (entry->used < victim->used)
+			victim = entry;
+	}
+	victim->hash = hash;
+	victim->used = ++routes->clock;
+	victim->rule = ROUTE_UNKNOWN;
+	victim->portind = portind;
+	victim->type = type;
+	victim->keylen = len;
+	memcpy(victim->key, key, len);
+	return victim;
+}
+/* Empty entries have used set to 0, so they're always taken first */
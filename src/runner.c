@@ -27,45 +27,100 @@
 #include <unistd.h>
 
 #include <swebs/util.h>
+#include <swebs/timer.h>
+#include <swebs/config.h>
 #include <swebs/runner.h>
 #include <swebs/sitefile.h>
 #include <swebs/connections.h>
 
+#if USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 typedef struct {
+#if USE_EPOLL
+	int epollfd;
+	int *fds;
+	struct epoll_event *events;
+#else
 	struct pollfd *fds;
+#endif
 	Connection *conns;
 	int len;
 	int alloc;
+
+	int *ready;
+	/* the fds that had events after the last pollConnList() */
+
+	int *indices;
+	int indalloc;
+	/* indices[fd] is the index of fd in conns, or -1. Connections move
+	 * around in removeConnList(), so events are tracked by fd. */
 } ConnList;
 
 static int createConnList(ConnList *list);
-static int addConnList(ConnList *list, struct pollfd *fd, Connection *conn);
+static int addConnList(ConnList *list, int fd, int edge, Connection *conn);
 static void removeConnList(ConnList *list, int ind);
-static void pollConnList(ConnList *list);
+static void watchWrites(ConnList *list, int ind, int watch);
+static int pollConnList(ConnList *list, int timeout);
+/* returns the amount of fds in list->ready */
+static int connIndex(ConnList *list, int fd);
 static void freeConnList(ConnList *list);
 
-void runServer(int connfd, Sitefile *site, volatile int *pending, int id) {
+static void addStream(ConnList *conns, TimerWheel *timers, Context *context,
+		int fd, int portind, WorkerLoad *load, Sitefile *site);
+/* fd should already be counted in load->connections */
+static void acceptAll(ConnList *conns, TimerWheel *timers, Listener *listener,
+		Context *context, int portind, WorkerLoad *load,
+		Sitefile *site);
+static void closeConnection(ConnList *conns, TimerWheel *timers, int ind,
+		WorkerLoad *load);
+static void armTimer(TimerWheel *timers, Connection *conn, int wasmid,
+		Sitefile *site);
+
+void runServer(int connfd, Sitefile *site, Listener **listeners,
+		WorkerLoad *loads, int id) {
 	Context **contexts;
 	int i;
+	int listenercount;
 	ConnList conns;
+	TimerWheel timers;
 
 	if (createConnList(&conns))
 		return;
+	if (createTimerWheel(&timers)) {
+		freeConnList(&conns);
+		return;
+	}
 
 	{
-		struct pollfd newfd;
 		Connection newconn;
 
-		newfd.fd = connfd;
-		newfd.events = POLLIN;
-
-		if (addConnList(&conns, &newfd, &newconn)) {
+		if (addConnList(&conns, connfd, 0, &newconn)) {
 			freeConnList(&conns);
 			return;
 		}
 	}
-	/* connections are 1 indexed because fds[0] is the notify fd. I hate
-	 * that poll() forces us to do these hacks. */
+	/* connections are 1 indexed because conns[0] is the notify fd. The
+	 * notify fd is level triggered since recvFds() only takes one batch at
+	 * a time. */
+
+	listenercount = 0;
+	if (listeners != NULL) {
+		for (i = 0; i < (int) site->portcount; ++i) {
+			Connection unused;
+			int fd;
+			fd = listenerfd(listeners[i]);
+			if (addConnList(&conns, fd, 1, &unused)) {
+				createLog("Couldn't add listener");
+				exit(EXIT_FAILURE);
+			}
+		}
+		listenercount = site->portcount;
+	}
+	/* conns[1] through conns[listenercount] are the listeners, if this
+	 * process accepts its own connections. They never get moved around
+	 * since removeConnList() is only ever called on connections. */
 
 	contexts = xmalloc(site->portcount * sizeof *contexts);
 
@@ -106,107 +161,369 @@ void runServer(int connfd, Sitefile *site, volatile int *pending, int id) {
 	}
 
 	for (;;) {
-		pollConnList(&conns);
+		int readycount, notified, fd;
+
+		readycount = pollConnList(&conns, nextTimer(&timers));
+		notified = 0;
+		updateTime();
 
 		createFormatLog("poll() finished with %d connections",
 				conns.len);
 
-		for (i = 1; i < conns.len; i++) {
-			if (conns.fds[i].revents & POLLIN) {
-				createFormatLog("Connection %d has data", i);
-				if (updateConnection(conns.conns + i, site)) {
-					freeConnection(conns.conns + i);
-					removeConnList(&conns, i);
-					--i;
+		while ((fd = expireTimer(&timers)) >= 0) {
+			int ind;
+			ind = connIndex(&conns, fd);
+			if (ind > 0 && ind <= listenercount) {
+				acceptAll(&conns, &timers, listeners[ind - 1],
+						contexts[ind - 1], ind - 1,
+						loads + id, site);
+				continue;
+			}
+			if (ind <= listenercount)
+				continue;
+			createLog("Connection timed out");
+			closeConnection(&conns, &timers, ind, loads + id);
+		}
+
+		for (i = 0; i < readycount; i++) {
+			int ind;
+			ind = connIndex(&conns, conns.ready[i]);
+			if (ind < 0)
+				continue;
+			/* The connection was closed earlier in this batch. */
+			if (ind == 0) {
+				notified = 1;
+				continue;
+			}
+			if (ind <= listenercount) {
+				acceptAll(&conns, &timers, listeners[ind - 1],
+						contexts[ind - 1], ind - 1,
+						loads + id, site);
+				continue;
+			}
+			createFormatLog("Connection %d has data", ind);
+			{
+				Connection *conn = conns.conns + ind;
+				int wasmid, ismid, failed;
+				wasmid = midRequest(conn);
+				failed = updateConnection(conn, site);
+				ismid = midRequest(conn);
+				if (ismid != wasmid)
+					__sync_fetch_and_add(&loads[id].requests,
+							ismid - wasmid);
+				if (failed) {
+					closeConnection(&conns, &timers, ind,
+							loads + id);
+					continue;
 				}
+				watchWrites(&conns, ind,
+						!queueEmpty(&conn->out) ||
+						(conn->progress == HANDSHAKE &&
+						 handshakeWriting(
+							 conn->stream)));
+				armTimer(&timers, conn, wasmid, site);
 			}
 		}
 
-		if (conns.fds[0].revents & POLLIN) {
-			Stream *newstream;
-			Connection newconn;
-			int portind;
-			struct pollfd newfd;
+		if (notified) {
+			int portinds[MAX_FD_BATCH];
+			int newfds[MAX_FD_BATCH];
+			int count, j;
 
 			createLog("Main fd has data");
-			newfd.fd = recvFd(connfd, &portind, sizeof portind);
-			if (newfd.fd < 0) {
-				createLog("Message received that included an invalid fd, quitting");
+			count = recvFds(connfd, newfds, MAX_FD_BATCH,
+					portinds, sizeof *portinds);
+			if (count < 0) {
+				createLog("Invalid message from the master, "
+						"quitting");
 				exit(EXIT_FAILURE);
 			}
-			newfd.events = POLLIN;
-
-			newstream = createStream(contexts[portind],
-					O_NONBLOCK, newfd.fd);
-			if (newstream == NULL) {
-				createLog(
-"Stream couldn't be created from file descriptor");
-				shutdown(newfd.fd, SHUT_RDWR);
-				close(newfd.fd);
-				continue;
+			for (j = 0; j < count; ++j) {
+				if (portinds[j] < 0 ||
+				    portinds[j] >= (int) site->portcount) {
+					__sync_fetch_and_sub(
+						&loads[id].connections, 1);
+					close(newfds[j]);
+					continue;
+				}
+				addStream(&conns, &timers,
+						contexts[portinds[j]],
+						newfds[j], portinds[j],
+						loads + id, site);
 			}
+		}
+	}
+}
 
-			if (newConnection(newstream, &newconn, portind)) {
-				createLog("Couldn't initialize connection from stream");
-				continue;
-			}
+static void addStream(ConnList *conns, TimerWheel *timers, Context *context,
+		int fd, int portind, WorkerLoad *load, Sitefile *site) {
+	Stream *newstream;
+	Connection newconn, *conn;
+	int mid;
+
+	newstream = createStream(context, O_NONBLOCK, fd);
+	if (newstream == NULL) {
+		createLog("Stream couldn't be created from file descriptor");
+		goto error;
+	}
 
-			if (addConnList(&conns, &newfd, &newconn)) {
-				freeConnection(&newconn);
+	if (newConnection(newstream, &newconn, portind)) {
+		createLog("Couldn't initialize connection from stream");
+		freeStream(newstream);
+		goto error;
+	}
+
+	if (addConnList(conns, fd, 1, &newconn)) {
+		freeConnection(&newconn);
+		goto error;
+	}
+	conn = conns->conns + connIndex(conns, fd);
+	mid = midRequest(conn);
+	if (mid)
+		__sync_fetch_and_add(&load->requests, 1);
+	/* TLS connections start out in their handshake, which counts */
+	armTimer(timers, conn, mid, site);
+	return;
+error:
+	__sync_fetch_and_sub(&load->connections, 1);
+}
+
+static void acceptAll(ConnList *conns, TimerWheel *timers, Listener *listener,
+		Context *context, int portind, WorkerLoad *load,
+		Sitefile *site) {
+	for (;;) {
+		int fd;
+		fd = acceptConnection(listener);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
 				continue;
-			}
-			pending[id]++;
+			break;
 		}
+		__sync_fetch_and_add(&load->connections, 1);
+		addStream(conns, timers, context, fd, portind, load, site);
+	}
+	if (errno == EMFILE || errno == ENFILE ||
+	    errno == ENOBUFS || errno == ENOMEM) {
+		if (setTimer(timers, listenerfd(listener), ACCEPT_RETRY))
+			createLog("setTimer() failed");
+	}
+}
+/* The listeners are edge triggered, so connections left waiting because there
+ * weren't any fds left won't come up again on their own. The listener's timer
+ * goes off later and tries again. */
+
+static void closeConnection(ConnList *conns, TimerWheel *timers, int ind,
+		WorkerLoad *load) {
+	Connection conn;
+	memcpy(&conn, conns->conns + ind, sizeof conn);
+	clearTimer(timers, conn.stream->fd);
+	if (midRequest(&conn))
+		__sync_fetch_and_sub(&load->requests, 1);
+	__sync_fetch_and_sub(&load->connections, 1);
+	removeConnList(conns, ind);
+	freeConnection(&conn);
+}
+/* The connection is taken out of the list while its fd is still open, since
+ * it has to be taken out of the epoll set by hand */
+
+static void armTimer(TimerWheel *timers, Connection *conn, int wasmid,
+		Sitefile *site) {
+/*
+ * Idle connections, request bodies and unsent responses get the whole timeout
+ * again whenever the connection makes progress. TLS handshakes, the request
+ * line and headers have to be done within the timeout of their start,
+ * otherwise a client could hold the connection forever by sending a byte at a
+ * time. Connections waiting for their next request use the keep-alive timeout.
+ * */
+	const int fd = conn->stream->fd;
+	const Port *port = site->ports + conn->portind;
+	const int timeout = !midRequest(conn) && port->keepalive > 0 ?
+		port->keepalive : port->timeout;
+	if (timeout <= 0) {
+		clearTimer(timers, fd);
+		return;
 	}
+	if (midRequest(conn) && conn->progress != RECEIVE_BODY && wasmid &&
+	    queueEmpty(&conn->out) && timerSet(timers, fd))
+		return;
+	if (setTimer(timers, fd, timeout))
+		createLog("setTimer() failed");
 }
 
 static int createConnList(ConnList *list) {
+	int i;
 	list->alloc = 100;
+#if USE_EPOLL
+	list->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (list->epollfd < 0) {
+		createErrorLog("epoll_create1() failed", errno);
+		return 1;
+	}
+	list->events = xmalloc(list->alloc * sizeof *list->events);
+#endif
 	list->fds = xmalloc(list->alloc * sizeof *list->fds);
 	list->conns = xmalloc(list->alloc * sizeof *list->conns);
+	list->ready = xmalloc(list->alloc * sizeof *list->ready);
 	list->len = 0;
+
+	list->indalloc = 100;
+	list->indices = xmalloc(list->indalloc * sizeof *list->indices);
+	for (i = 0; i < list->indalloc; ++i)
+		list->indices[i] = -1;
 	return 0;
 }
 
-static int addConnList(ConnList *list, struct pollfd *fd, Connection *conn) {
+static int addConnList(ConnList *list, int fd, int edge, Connection *conn) {
 	if (list->len >= list->alloc) {
 		int newalloc;
-		struct pollfd *newfds;
 		Connection *newconns;
+		int *newready;
 		newalloc = list->alloc * 2;
-		newfds = realloc(list->fds, newalloc * sizeof *list->fds);
-		if (newfds == NULL)
-			return 1;
+		{
+#if USE_EPOLL
+			int *newfds;
+			struct epoll_event *newevents;
+			newevents = realloc(list->events,
+					newalloc * sizeof *list->events);
+			if (newevents == NULL)
+				return 1;
+			list->events = newevents;
+#else
+			struct pollfd *newfds;
+#endif
+			newfds = realloc(list->fds, newalloc * sizeof *list->fds);
+			if (newfds == NULL)
+				return 1;
+			list->fds = newfds;
+		}
 		newconns = realloc(list->conns, newalloc * sizeof *list->conns);
 		if (newconns == NULL)
 			return 1;
-		list->alloc = newalloc;
-		list->fds = newfds;
 		list->conns = newconns;
+		newready = realloc(list->ready, newalloc * sizeof *list->ready);
+		if (newready == NULL)
+			return 1;
+		list->ready = newready;
+		list->alloc = newalloc;
+	}
+	if (fd >= list->indalloc) {
+		int newalloc, *newindices, i;
+		newalloc = list->indalloc;
+		while (newalloc <= fd)
+			newalloc *= 2;
+		newindices = realloc(list->indices,
+				newalloc * sizeof *list->indices);
+		if (newindices == NULL)
+			return 1;
+		for (i = list->indalloc; i < newalloc; ++i)
+			newindices[i] = -1;
+		list->indices = newindices;
+		list->indalloc = newalloc;
+	}
+
+#if USE_EPOLL
+	{
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLRDHUP;
+		if (edge)
+			event.events |= EPOLLET | EPOLLOUT;
+		/* Edge triggered writability only shows up when a full
+		 * send buffer drains, so it can always be on. */
+		event.data.fd = fd;
+		if (epoll_ctl(list->epollfd, EPOLL_CTL_ADD, fd, &event)) {
+			createErrorLog("epoll_ctl() failed", errno);
+			return 1;
+		}
 	}
-	memcpy(list->fds + list->len, fd, sizeof *fd);
+	list->fds[list->len] = fd;
+#else
+	(void) edge;
+	list->fds[list->len].fd = fd;
+	list->fds[list->len].events = POLLIN;
+#endif
 	memcpy(list->conns + list->len, conn, sizeof *conn);
+	list->indices[fd] = list->len;
 	++list->len;
 	return 0;
 }
 
 static void removeConnList(ConnList *list, int ind) {
 	const int replace = list->len - 1;
+	int fd;
 
-	memcpy(list->fds + ind, list->fds + replace, sizeof *list->fds);
-	memcpy(list->conns + ind, list->conns + replace, sizeof *list->conns);
+#if USE_EPOLL
+	fd = list->fds[ind];
+	if (epoll_ctl(list->epollfd, EPOLL_CTL_DEL, fd, NULL))
+		createErrorLog("epoll_ctl() failed", errno);
+	/* Closing fd isn't enough when there are other fds for the same file,
+	 * like dup()s in child processes, it would stay in the set. */
+#else
+	fd = list->fds[ind].fd;
+#endif
+	list->indices[fd] = -1;
+
+	if (ind != replace) {
+		memcpy(list->fds + ind, list->fds + replace, sizeof *list->fds);
+		memcpy(list->conns + ind, list->conns + replace,
+				sizeof *list->conns);
+#if USE_EPOLL
+		list->indices[list->fds[ind]] = ind;
+#else
+		list->indices[list->fds[ind].fd] = ind;
+#endif
+	}
 
 	--list->len;
 }
 
-static void pollConnList(ConnList *list) {
-	poll(list->fds, list->len, -1);
+static void watchWrites(ConnList *list, int ind, int watch) {
+#if USE_EPOLL
+	(void) list;
+	(void) ind;
+	(void) watch;
+#else
+	list->fds[ind].events = watch ? POLLIN | POLLOUT : POLLIN;
+#endif
+}
+
+static int pollConnList(ConnList *list, int timeout) {
+#if USE_EPOLL
+	int i, count;
+	count = epoll_wait(list->epollfd, list->events, list->alloc, timeout);
+	if (count < 0)
+		return 0;
+	for (i = 0; i < count; ++i)
+		list->ready[i] = list->events[i].data.fd;
+	return count;
+#else
+	int i, count;
+	if (poll(list->fds, list->len, timeout) < 0)
+		return 0;
+	count = 0;
+	for (i = 0; i < list->len; ++i)
+		if (list->fds[i].revents &
+				(POLLIN | POLLOUT | POLLERR | POLLHUP))
+			list->ready[count++] = list->fds[i].fd;
+	return count;
+#endif
+}
+
+static int connIndex(ConnList *list, int fd) {
+	if (fd < 0 || fd >= list->indalloc)
+		return -1;
+	return list->indices[fd];
 }
 
 static void freeConnList(ConnList *list) {
 	int i;
-	for (i = 0; i < list->len; ++i)
+	for (i = 1; i < list->len; ++i)
 		freeConnection(list->conns + i);
+#if USE_EPOLL
+	close(list->epollfd);
+	free(list->events);
+#endif
 	free(list->fds);
 	free(list->conns);
+	free(list->ready);
+	free(list->indices);
 }
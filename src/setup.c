@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <errno.h>
 #include <unistd.h>
@@ -59,7 +60,7 @@ static void printLongMessage(char *first, ...) {
 }
 
 void setup(int argc, char **argv, Sitefile **site, int *processes,
-		int *backlog) {
+		int *backlog, int *reuseport, BalancePolicy *policy) {
 	char *logout = "/var/log/swebs.log";
 	char *sitefile = NULL;
 	char shouldDaemonize = 0;
@@ -67,9 +68,11 @@ void setup(int argc, char **argv, Sitefile **site, int *processes,
 
 	*processes = sysconf(_SC_NPROCESSORS_ONLN) + 1;
 	*backlog = 100;
+	*reuseport = 0;
+	*policy = LEAST_CONNECTIONS;
 
 	for (;;) {
-		int c = getopt(argc, argv, "o:j:s:b:c:Bp:hl");
+		int c = getopt(argc, argv, "o:j:s:b:c:Bp:hlRL:");
 		if (c == -1)
 			break;
 		switch (c) {
@@ -88,6 +91,23 @@ void setup(int argc, char **argv, Sitefile **site, int *processes,
 			case 'B':
 				shouldDaemonize = 1;
 				break;
+			case 'R':
+				*reuseport = 1;
+				break;
+			case 'L':
+				if (strcmp(optarg, "least") == 0)
+					*policy = LEAST_CONNECTIONS;
+				else if (strcmp(optarg, "two") == 0)
+					*policy = TWO_CHOICES;
+				else if (strcmp(optarg, "roundrobin") == 0)
+					*policy = ROUND_ROBIN;
+				else {
+					fprintf(stderr,
+						"Invalid balancing policy %s\n",
+						optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
 			case 'p':
 				pidfile = optarg;
 				break;
@@ -117,6 +137,12 @@ NULL
 "  -B                        Run swebs in the background and daemonize",
 "  -p [pidfile]              Specify PID file if daemonizing",
 "                              (defualt: /run/swebs.pid)",
+"  -R                        Have every process accept its own connections",
+"                              with SO_REUSEPORT",
+"  -L [policy]               Set how connections are spread between processes",
+"                              least: fewest open connections (default)",
+"                              two: the better of two random processes",
+"                              roundrobin: every process in turn",
 "  -l                        Show some legal details",
 "  -h                        Show this help message",
 NULL
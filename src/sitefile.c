@@ -252,6 +252,13 @@ static CommandReturn globalvar(LocalVars *vars, Sitefile *sitefile,
 		return COMMAND_RET_ERROR;
 #endif
 	}
+	if (strcmp(argv[1], "cache-memory") == 0) {
+		char *end;
+		sitefile->files.budget = strtoul(argv[2], &end, 10);
+		if (end == argv[2] || *end != '\0')
+			return COMMAND_RET_ERROR;
+		return DATA_CHANGE;
+	}
 	return COMMAND_RET_ERROR;
 }
 
@@ -284,6 +291,8 @@ static CommandReturn declareport(LocalVars *vars, Sitefile *sitefile,
 		return COMMAND_RET_ERROR;
 	}
 	newport.timeout = 2000;
+	newport.keepalive = -1;
+	newport.maxrequests = 0;
 	newport.key = newport.cert = NULL;
 	if (sitefile->portcount >= sitefile->portalloc) {
 		sitefile->portalloc *= 2;
@@ -300,12 +309,12 @@ static CommandReturn portvar(LocalVars *vars, Sitefile *sitefile,
 		int argc, char **argv) {
 	(void) vars;
 	(void) sitefile;
-#define PORT_ATTRIBUTE(name, func) \
-	if (strcmp(argv[0], #name) == 0) { \
+#define PORT_ATTRIBUTE(command, name, func) \
+	if (strcmp(argv[0], command) == 0) { \
 		size_t i; \
 		unsigned short port; \
 		if (argc < 3) { \
-			fputs("Usage: " #name " [" #name "] [port]\n", \
+			fputs("Usage: " command " [" #name "] [port]\n", \
 					stderr); \
 			return COMMAND_RET_ERROR; \
 		} \
@@ -315,9 +324,11 @@ static CommandReturn portvar(LocalVars *vars, Sitefile *sitefile,
 				sitefile->ports[i].name = func(argv[1]); \
 		return DATA_CHANGE; \
 	}
-	PORT_ATTRIBUTE(key, xstrdup)
-	PORT_ATTRIBUTE(cert, xstrdup)
-	PORT_ATTRIBUTE(timeout, atoi)
+	PORT_ATTRIBUTE("key", key, xstrdup)
+	PORT_ATTRIBUTE("cert", cert, xstrdup)
+	PORT_ATTRIBUTE("timeout", timeout, atoi)
+	PORT_ATTRIBUTE("keepalive-timeout", keepalive, atoi)
+	PORT_ATTRIBUTE("keepalive-requests", maxrequests, atol)
 #undef PORT_ATTRIBUTE
 	return COMMAND_RET_ERROR;
 }
@@ -331,6 +342,7 @@ static int expandsitefile(Sitefile *sitefile, char *regex) {
 		sitefile->content = newcontent;
 	}
 
+	sitefile->content[sitefile->size].pathpattern = xstrdup(regex);
 	return regcomp(&sitefile->content[sitefile->size].path, regex, CFLAGS);
 }
 
@@ -386,6 +398,33 @@ static CommandReturn linkedsitespec(LocalVars *vars, Sitefile *sitefile,
 #endif
 }
 
+static int buildRoutes(Sitefile *site) {
+	size_t i, j;
+	int k, flags;
+	if (initRoutes(&site->routes, site->portcount))
+		return 1;
+	for (i = 0; i < site->size; i++) {
+		SiteCommand *command = site->content + i;
+		for (j = 0; j < site->portcount; j++) {
+			for (k = 0; k < command->portcount; k++)
+				if (command->ports[k] == site->ports[j].num)
+					break;
+			if (k >= command->portcount)
+				continue;
+			flags = addRoute(&site->routes, j, command->respondto,
+					command->hostpattern,
+					command->pathpattern, i);
+			if (flags < 0)
+				return 1;
+			command->recheck |= flags;
+		}
+	}
+	finishRoutes(&site->routes);
+	return 0;
+}
+/* Rules for ports that were never declared can't match anything and are left
+ * out */
+
 Sitefile *parseSitefile(char *path) {
 	FILE *file;
 	int argc;
@@ -406,6 +445,8 @@ Sitefile *parseSitefile(char *path) {
 		{"key",     portvar},
 		{"cert",    portvar},
 		{"timeout", portvar},
+		{"keepalive-timeout", portvar},
+		{"keepalive-requests", portvar},
 	};
 	LocalVars vars;
 
@@ -427,6 +468,9 @@ Sitefile *parseSitefile(char *path) {
 	ret->portcount = 0;
 	ret->portalloc = 5;
 	ret->ports = xmalloc(ret->portalloc * sizeof *ret->ports);
+	ret->routes.buckets = NULL;
+	initMimeTable(&ret->mime);
+	initFileCache(&ret->files);
 #if DYNAMIC_LINKED_PAGES
 	ret->getResponse = NULL;
 #endif
@@ -448,6 +492,14 @@ nextcommand:
 					goto nterror;
 				}
 			}
+			if (buildRoutes(ret))
+				goto nterror;
+			if (shareFileCache(&ret->files)) {
+				fprintf(stderr,
+"Couldn't map %lu bytes for the file cache\n",
+					(unsigned long) ret->files.budget);
+				goto nterror;
+			}
 			free(vars.ports);
 			free(vars.contenttype);
 			free(vars.host);
@@ -478,6 +530,8 @@ newsitespec:
 		freecommand(argc, argv);
 		ret->content[ret->size].respondto = vars.respondto;
 		regcomp(&ret->content[ret->size].host, vars.host, CFLAGS);
+		ret->content[ret->size].hostpattern = xstrdup(vars.host);
+		ret->content[ret->size].recheck = 0;
 
 		ret->content[ret->size].ports = xmalloc(vars.portcount *
 				sizeof *ret->content[ret->size].ports);
@@ -486,6 +540,8 @@ newsitespec:
 		ret->content[ret->size].portcount = vars.portcount;
 
 		ret->content[ret->size].contenttype = xstrdup(vars.contenttype);
+		ret->content[ret->size].mime = internMime(&ret->mime,
+				vars.contenttype);
 
 		++ret->size;
 	}
@@ -504,6 +560,8 @@ void freeSitefile(Sitefile *site) {
 	for (i = 0; i < site->size; ++i) {
 		regfree(&site->content[i].path);
 		regfree(&site->content[i].host);
+		free(site->content[i].hostpattern);
+		free(site->content[i].pathpattern);
 		free(site->content[i].arg);
 		free(site->content[i].ports);
 		free(site->content[i].contenttype);
@@ -514,5 +572,8 @@ void freeSitefile(Sitefile *site) {
 		free(site->ports[i].cert);
 	}
 	free(site->ports);
+	freeRoutes(&site->routes);
+	freeMimeTable(&site->mime);
+	freeFileCache(&site->files);
 	free(site);
 }
@@ -15,30 +15,42 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#define _DEFAULT_SOURCE
+/* SO_REUSEPORT */
+
 #include <stdarg.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <gnutls/gnutls.h>
 
 #include <swebs/util.h>
+#include <swebs/config.h>
 #include <swebs/sockets.h>
 
+#define HAVE_KTLS (USE_ZEROCOPY && USE_KTLS && \
+		GNUTLS_VERSION_NUMBER >= 0x030703)
+#if HAVE_KTLS
+#include <gnutls/socket.h>
+#endif
+
 int initTLS() {
 	assert(gnutls_global_init() >= 0);
 	return 0;
 }
 
-Listener *createListener(unsigned short port, int backlog) {
+Listener *createListener(unsigned short port, int backlog, int reuseport) {
 	Listener *ret = malloc(sizeof(Listener));
 	if (ret == NULL)
 		return NULL;
-	ret->fd = socket(AF_INET, SOCK_STREAM, 0);
+	ret->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (ret->fd < 0) {
 		free(ret);
 		return NULL;
@@ -50,6 +62,9 @@ Listener *createListener(unsigned short port, int backlog) {
 			free(ret);
 			return NULL;
 		}
+		if (reuseport && setsockopt(ret->fd, SOL_SOCKET, SO_REUSEPORT,
+					&opt, sizeof(opt)))
+			goto error;
 	}
 	ret->addr.sin_family = AF_INET;
 	ret->addr.sin_addr.s_addr = INADDR_ANY;
@@ -129,10 +144,13 @@ int acceptConnection(Listener *listener) {
 
 Stream *createStream(Context *context, int flags, int fd) {
 	Stream *ret = malloc(sizeof(Stream));
-	if (ret == NULL)
+	if (ret == NULL) {
+		close(fd);
 		return NULL;
+	}
 	ret->type = context->type;
 	ret->fd = fd;
+	ret->ktls = 0;
 
 	{
 		int oldflags = fcntl(ret->fd, F_GETFL);
@@ -143,33 +161,30 @@ Stream *createStream(Context *context, int flags, int fd) {
 		case TCP: default:
 			break;
 		case TLS:
-			if (gnutls_init(&ret->session, GNUTLS_SERVER) < 0) {
+			if (gnutls_init(&ret->session,
+					GNUTLS_SERVER | GNUTLS_NONBLOCK) < 0) {
 				createLog("gnutls_init() failed");
 				goto error;
 			}
 			if (gnutls_priority_set(ret->session,
 					context->priority) < 0) {
 				createLog("gnutls_priority_set() failed");
-				goto error;
+				goto deinit;
 			}
 			if (gnutls_credentials_set(ret->session,
 					GNUTLS_CRD_CERTIFICATE,
 					context->creds) < 0) {
 				createLog("gnutls_credentials_set() failed");
-				goto error;
+				goto deinit;
 			}
 			gnutls_certificate_server_set_request(ret->session,
 					GNUTLS_CERT_IGNORE);
-			gnutls_handshake_set_timeout(ret->session,
-					GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
 			gnutls_transport_set_int(ret->session, ret->fd);
-			if (gnutls_handshake(ret->session) < 0) {
-				createLog("gnutls_handshake() failed");
-				goto error;
-			}
 			break;
 	}
 	return ret;
+deinit:
+	gnutls_deinit(ret->session);
 error:
 	shutdown(ret->fd, SHUT_RDWR);
 	close(ret->fd);
@@ -177,6 +192,31 @@ error:
 	return NULL;
 }
 
+int handshakeStream(Stream *stream) {
+	int code;
+	if (stream->type != TLS)
+		return 0;
+	code = gnutls_handshake(stream->session);
+	if (code >= 0) {
+#if HAVE_KTLS
+		stream->ktls = (gnutls_transport_is_ktls_enabled(
+				stream->session) & GNUTLS_KTLS_SEND) != 0;
+#endif
+		return 0;
+	}
+	if (code == GNUTLS_E_AGAIN || code == GNUTLS_E_INTERRUPTED ||
+	    !gnutls_error_is_fatal(code))
+		return 1;
+	createFormatLog("gnutls_handshake() failed: %s",
+			gnutls_strerror(code));
+	return -1;
+}
+
+int handshakeWriting(Stream *stream) {
+	return stream->type == TLS &&
+		gnutls_record_get_direction(stream->session) == 1;
+}
+
 void freeListener(Listener *listener) {
 	close(listener->fd);
 	free(listener);
@@ -209,6 +249,37 @@ ssize_t sendStream(Stream *stream, const void *data, size_t len) {
 	}
 }
 
+ssize_t sendStreamv(Stream *stream, const struct iovec *iov, int iovcnt) {
+	switch (stream->type) {
+		case TCP:
+			return writev(stream->fd, iov, iovcnt);
+		case TLS: {
+			char record[16384];
+			size_t len;
+			int i;
+			if (iov[0].iov_len >= sizeof record)
+				return gnutls_record_send(stream->session,
+						iov[0].iov_base,
+						sizeof record);
+			len = 0;
+			for (i = 0; i < iovcnt; ++i) {
+				size_t add = iov[i].iov_len;
+				if (add > sizeof record - len)
+					add = sizeof record - len;
+				memcpy(record + len, iov[i].iov_base, add);
+				len += add;
+			}
+			return gnutls_record_send(stream->session,
+					record, len);
+			/* If this returns GNUTLS_E_AGAIN then the next call
+			 * has to be the same length, which it will be since
+			 * the buffers haven't changed. */
+		}
+		default:
+			return -1;
+	}
+}
+
 ssize_t recvStream(Stream *stream, void *data, size_t len) {
 	switch (stream->type) {
 		case TCP:
@@ -0,0 +1,87 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+/* memfd_create() and splice(). This file can't include gnutls, which doesn't
+ * compile with -ansi once _GNU_SOURCE is set. */
+#include <stdio.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <swebs/spill.h>
+
+#define SPLICE_MAX 65536
+/* The default pipe capacity, so a single splice never fills the pipe */
+
+int createSpill(void) {
+	FILE *file;
+	int ret;
+#ifdef MFD_CLOEXEC
+	ret = memfd_create("swebs-body", MFD_CLOEXEC);
+	if (ret >= 0 || errno != ENOSYS)
+		return ret;
+#endif
+	file = tmpfile();
+	if (file == NULL)
+		return -1;
+	ret = dup(fileno(file));
+	fclose(file);
+	return ret;
+}
+
+int writeSpill(int fd, const void *data, size_t len) {
+	const char *p = data;
+	while (len > 0) {
+		ssize_t written;
+		written = write(fd, p, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		p += written;
+		len -= written;
+	}
+	return 0;
+}
+
+ssize_t spliceSpill(int sock, int fd, size_t len, int pipes[2]) {
+	ssize_t got, moved;
+	if (pipes[0] < 0 && pipe(pipes))
+		return -1;
+	if (len > SPLICE_MAX)
+		len = SPLICE_MAX;
+	got = splice(sock, NULL, pipes[1], NULL, len,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (got <= 0)
+		return got;
+	for (moved = 0; moved < got;) {
+		ssize_t add;
+		add = splice(pipes[0], NULL, fd, NULL, got - moved,
+				SPLICE_F_MOVE);
+		if (add < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		moved += add;
+	}
+	return got;
+}
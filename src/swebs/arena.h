@@ -0,0 +1,71 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_ARENA
+#define HAVE_ARENA
+#include <stddef.h>
+
+#define ARENA_START 2048
+/* The size of a new connection's first block */
+#define ARENA_MAX 65536
+/* The first block never grows past this, anything bigger is given its own
+ * block for the length of one request. */
+
+typedef union {
+	long l;
+	double d;
+	long double ld;
+	void *p;
+} ArenaAlign;
+/* Everything handed out is aligned for any of these */
+
+typedef struct ArenaBlock {
+	struct ArenaBlock *next;
+	size_t size;
+	size_t used;
+	ArenaAlign data[1];
+} ArenaBlock;
+
+typedef struct {
+	ArenaBlock *first;
+	ArenaBlock *current;
+	size_t total;
+	/* how much has been handed out since the last reset */
+	void *last;
+	/* the most recent allocation, which can be grown in place */
+	size_t size;
+	/* how big the first block should be when it's next allocated */
+} Arena;
+
+int initArena(Arena *arena, size_t size);
+/* returns non-zero on error */
+void *arenaAlloc(Arena *arena, size_t size);
+void *arenaRealloc(Arena *arena, void *ptr, size_t oldsize, size_t newsize);
+/* These return NULL on error. Nothing gets freed on its own, it all goes at
+ * once with resetArena(). */
+void resetArena(Arena *arena);
+/*
+ * Throws away everything allocated from the arena. Normally this only rewinds
+ * the first block, if the last request didn't fit then the extra blocks are
+ * freed and the first block is replaced with one big enough for it, up to
+ * ARENA_MAX.
+ * */
+void releaseArena(Arena *arena);
+/* Frees all of the arena's memory, but remembers how big it had to be. The
+ * next allocation brings back a first block of that size. */
+void freeArena(Arena *arena);
+#endif
@@ -0,0 +1,104 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_AUTOMATON
+#define HAVE_AUTOMATON
+#include <stddef.h>
+
+#define DFA_MAX_STATES 1024
+/* How many states an automaton caches before it throws them all out, must be
+ * a power of 2 */
+#define NFA_MAX_NODES 4096
+/* Patterns that need more NFA nodes than this are left to regexec() */
+#define NFA_MAX_REPEAT 32
+/* The biggest count allowed in a {m,n} interval */
+
+typedef enum {
+	NFA_EPSILON,
+	NFA_SPLIT,
+	NFA_SET,
+	NFA_MATCH
+} NfaType;
+
+typedef struct {
+	NfaType type;
+	int out;
+	int arg;
+	/* The other branch for NFA_SPLIT, the index into sets for NFA_SET and
+	 * the rule for NFA_MATCH */
+} NfaNode;
+
+typedef struct {
+	int *nodes;
+	size_t nodecount;
+	/* The NFA_SET and NFA_MATCH nodes the DFA state stands for */
+	int *accept;
+	size_t acceptcount;
+	/* The rules that match if the string ends here, in order */
+	int *next;
+	/* The next state for each byte class, -1 if it hasn't been built */
+} DfaState;
+
+typedef struct {
+	NfaNode *nodes;
+	size_t nodecount;
+	size_t nodealloc;
+	unsigned char (*sets)[32];
+	size_t setcount;
+	size_t setalloc;
+	/* Bitsets of lowercase bytes */
+	int *starts;
+	size_t startcount;
+	size_t startalloc;
+
+	unsigned char classes[256];
+	int classcount;
+	unsigned char *representatives;
+	/* Bytes that go to the same places share a class. classes[] is indexed
+	 * by the input byte, case is already folded. */
+
+	DfaState *states;
+	size_t statecount;
+	int *table;
+	int start;
+	int *stack;
+	int *seeds;
+	int *closure;
+	unsigned int *marks;
+	unsigned int generation;
+	/* The lazily built DFA and scratch space for building it. Every process
+	 * has its own copy. */
+} Automaton;
+
+void initAutomaton(Automaton *automaton);
+int addPattern(Automaton *automaton, const char *regex, int rule);
+/*
+ * Adds a case insensitive POSIX extended regex that has to match the entire
+ * string. Returns non-zero and adds nothing if the regex uses something the
+ * automaton can't do (back references, \w, anchors in the middle, collating
+ * elements and such). The rules have to be added in increasing order.
+ * */
+void finishAutomaton(Automaton *automaton);
+/* Call once every pattern has been added */
+int runAutomaton(Automaton *automaton, const char *str,
+		const int **matches, size_t *count);
+/*
+ * Sets matches to every rule that matches str, lowest first. They stay valid
+ * until the next run. Returns non-zero on error.
+ * */
+void freeAutomaton(Automaton *automaton);
+#endif
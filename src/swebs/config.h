@@ -11,6 +11,15 @@
 #define DYNAMIC_LINKED_PAGES 1
 #define SERVER_PATH "/tmp/swebs-serverXXXXX"
 /* Where the UNIX server goes */
+#define USE_EPOLL 1
+/* Use edge triggered epoll() instead of poll() in the worker processes. poll()
+ * is kept around for comparison and for non Linux systems. */
+#define USE_ZEROCOPY 1
+/* Send files on TCP ports with sendfile() and splice() instead of reading them
+ * in first. Linux only. */
+#define USE_KTLS 1
+/* Do the same on TLS ports when gnutls has set up kernel TLS for a connection.
+ * Needs USE_ZEROCOPY and gnutls 3.7.3 or later. */
 
 #endif
 /* HEADER GUARD, DO NOT REMOVE*/
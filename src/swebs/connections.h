@@ -19,62 +19,119 @@
 #define HAVE_CONNECTIONS
 
 #include <swebs/types.h>
+#include <swebs/arena.h>
 #include <swebs/runner.h>
 #include <swebs/sockets.h>
+#include <swebs/outqueue.h>
 #include <swebs/sitefile.h>
 
 typedef enum {
+	HANDSHAKE,
 	RECEIVE_REQUEST,
 	RECEIVE_HEADER,
 	RECEIVE_BODY
 } ConnectionSteps;
 
+typedef enum {
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_END,
+	/* the \r\n after each chunk */
+	CHUNK_TRAILER
+} ChunkSteps;
+/* Where a chunked request body is at */
+
+#define BODY_MEMORY 65536
+/* Request bodies bigger than this are written out to a file */
+#define MAX_BODY (1L << 30)
+/* Request bodies bigger than this are refused with a 413 */
+
 typedef struct Connection {
 	Stream *stream;
 	ConnectionSteps progress;
 
-	struct timespec lastdata;
-	/* the last time that data was received from this connection. */
-
 	RequestType type;
 	BinaryString path;
-	long pathFieldCount;
-	long allocatedPathFields;
-	PathField *pathFields;
-	/* ephemeral */
+	char *query;
+	/* ephemeral, both point into buff. query is still encoded, NULL if
+	 * there wasn't one */
 
 	Field *fields;
-	/* pointer to array of 2 pointers, persistent */
+	/* pointer to array of 2 pointers into buff, ephemeral */
 	size_t fieldCount;
 	size_t allocatedFields;
+	long known[HEADER_COUNT];
+	/* where the well known headers are in fields, -1 if they aren't */
 
 	char *body;
-	/* ephemeral */
+	/* ephemeral, NULL if the body is in bodyfd */
+	int bodyfd;
+	/* ephemeral, -1 unless the body was too big to keep in memory */
 	size_t bodylen;
 	size_t receivedBody;
+	size_t bodyAlloc;
+	/* how much body can take before it has to grow */
+	int chunked;
+	ChunkSteps chunkStep;
+	size_t chunkLeft;
+	size_t headEnd;
+	/* where the body starts in buff, body bytes are only kept in buff until
+	 * they've been moved to body or bodyfd */
+	int pipes[2];
+	/* persistent, used to splice bodies into bodyfd, -1 until needed */
 
-	char *currLine;
-	/* persistent */
-	size_t currLineAlloc;
-	size_t currLineLen;
+	char *buff;
+	/* persistent, requests are received into here and parsed in place */
+	size_t buffAlloc;
+	size_t buffLen;
+	size_t lineStart;
+	/* where the line currently being parsed starts */
+	size_t scanned;
+	/* how far into buff has already been checked for a newline */
 
 	int portind;
+	int http10;
+	/* HTTP/1.0 only keeps connections open when it's asked to */
+	int keepalive;
+	/* whether the connection stays open after the current request */
+	long requests;
+	/* how many requests this connection has made */
+
+	Arena arena;
+	/* persistent, everything ephemeral is allocated out of here */
+
+	OutQueue out;
+	/* responses that haven't been fully sent yet */
+	int closing;
+	/* close the connection once out is empty */
 } Connection;
 /*
  * The 2 types of fields:
- * Persistent fields: Things which aren't freed after a reset, currLine, fields
- * Ephemeral fields: Things which are freed and reallocated after each new
- * request, path, body
+ * Persistent fields: Things which aren't freed after a reset, buff, arena
+ * Ephemeral fields: Things which are forgotten after each request, path,
+ * fields, body. They're in the arena, which is rewound all at once.
  * */
 
 int newConnection(Stream *stream, Connection *ret, int portind);
 /* returns non-zero on error. */
 void resetConnection(Connection *conn);
 void freeConnection(Connection *conn);
+int nextQueryPair(Connection *conn, long *pos, BinaryString *var,
+		BinaryString *value);
+/* Decodes the next var=value pair of the query string into the arena. *pos
+ * starts at 0. Returns 1 for each pair, 0 once there are none left and -1 if
+ * one is malformed. */
+BinaryString *findQuery(Connection *conn, char *var);
+/* Decodes the value of the first var in the query string into the arena, or
+ * returns NULL if there isn't one. */
+int midRequest(Connection *conn);
+/* returns non-zero if the connection is still in its TLS handshake, if part of
+ * a request has been received, or if a response hasn't been fully sent yet. */
 int updateConnection(Connection *conn, Sitefile *site);
 /*
- * returns non-zero on error.
- * Generating a new connection and repeatedly calling updateConnection will
- * handle everything.
+ * returns non-zero on error or once the connection should be closed.
+ * Generating a new connection and repeatedly calling updateConnection whenever
+ * the stream is readable or writable will handle everything except for
+ * timeouts, which are up to the caller.
  * */
 #endif
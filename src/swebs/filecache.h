@@ -0,0 +1,145 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_FILECACHE
+#define HAVE_FILECACHE
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FILE_CACHE_SETS 32
+#define FILE_CACHE_WAYS 4
+/* Each worker keeps up to FILE_CACHE_SETS * FILE_CACHE_WAYS files open,
+ * FILE_CACHE_SETS must be a power of 2 */
+#define FILE_CACHE_TTL 1000
+/* How long in milliseconds a file is trusted before its path is resolved
+ * again, which is how renamed or deleted files get noticed */
+#define FILE_CACHE_KEY 256
+/* Longer request paths aren't cached */
+#define FILE_CACHE_BODY 16384
+/* Files up to this size are kept in memory as a complete response */
+#define FILE_CACHE_MEMORY (16L << 20)
+/* The default for how much memory those responses can take up, shared between
+ * all of the workers */
+#define SHARED_CACHE_SETS 256
+#define SHARED_CACHE_WAYS 4
+/* How many responses can be kept at once, SHARED_CACHE_SETS must be a power
+ * of 2 */
+
+typedef struct {
+	unsigned long hash;
+	unsigned long used;
+	/* When the entry was last hit, the least recent one in a set goes */
+	long opened;
+	/* currentTime() when the path was resolved */
+	int rule;
+	int fd;
+	size_t keylen;
+	char key[FILE_CACHE_KEY];
+	/* The request path, empty for rules that point at a single file */
+} FileCacheEntry;
+/* used is 0 for unused entries */
+
+typedef struct {
+	volatile unsigned long generation;
+	/* Odd while a worker is changing the slot, readers check that it's the
+	 * same even number before and after they look at it */
+	unsigned long hash;
+	long opened;
+	volatile long used;
+	/* currentTime() when the response was last sent, the least recent one
+	 * in a set makes way for new responses */
+	int rule;
+	size_t keylen;
+	char key[FILE_CACHE_KEY];
+	unsigned long start;
+	size_t len;
+	size_t split;
+	/* The response from buildResponse() is len bytes at start in the ring,
+	 * start keeps counting up instead of wrapping around */
+} SharedSlot;
+/* len is 0 for empty slots */
+
+typedef struct {
+	volatile pid_t lock;
+	/* The pid of whichever worker is changing the cache, 0 if none is */
+	volatile unsigned long head;
+	/* Where the next response goes, anything more than the size of the
+	 * ring behind it has been written over */
+	SharedSlot slots[SHARED_CACHE_SETS * SHARED_CACHE_WAYS];
+} SharedHeader;
+
+typedef struct {
+	size_t len;
+	size_t split;
+	SharedSlot *slot;
+	unsigned long generation;
+	unsigned long start;
+} SharedHit;
+/* A response found by findResponse(), to be checked by finishResponse() */
+
+typedef struct {
+	FileCacheEntry *entries;
+	unsigned long clock;
+	/* Allocated on first use, so every worker gets its own */
+	SharedHeader *shared;
+	char *ring;
+	size_t budget;
+	/* Mapped once before the workers are forked so that they all see the
+	 * same responses, shared is NULL if budget is 0. budget is the size of
+	 * the ring. */
+} FileCache;
+
+void initFileCache(FileCache *cache);
+int shareFileCache(FileCache *cache);
+/* Maps the shared part of the cache, call it after budget is set and before
+ * any workers are forked. Returns non-zero on error. */
+void freeFileCache(FileCache *cache);
+/* Closes every cached fd */
+void recoverFileCache(FileCache *cache, pid_t pid);
+/* For the master once it has reaped a worker. If the worker died while it was
+ * changing the shared cache, the lock is released and whatever it was working
+ * on is thrown out. */
+FileCacheEntry *findFile(FileCache *cache, int rule, const char *path);
+/* Returns the open file for path under rule, or NULL if it isn't cached or has
+ * been cached for longer than FILE_CACHE_TTL */
+FileCacheEntry *cacheFile(FileCache *cache, int rule, const char *path,
+		int fd);
+/* Keeps a dup() of fd, which has to be a regular file that passed the
+ * rule's checks. Returns NULL if it couldn't, which isn't an error. */
+const char *findResponse(FileCache *cache, int rule, const char *path,
+		SharedHit *hit);
+/*
+ * Returns the prebuilt response for path under rule, hit->len bytes long, or
+ * NULL like findFile(). No locks are taken, so another worker can write over
+ * the response at any time. Copy it out and then check the copy with
+ * finishResponse().
+ * */
+int finishResponse(FileCache *cache, const SharedHit *hit);
+/*
+ * Returns non-zero if the response was written over while it was being copied.
+ * Otherwise it's counted as used, and moved back to the head of the ring if it
+ * was about to be written over, so responses that keep being sent stay around.
+ * */
+int keepResponse(FileCache *cache, int rule, const char *path,
+		const char *response, size_t len, size_t split);
+/*
+ * Copies a response from buildResponse() into the shared cache, writing over
+ * the oldest ones in the ring and replacing the least recently used one in its
+ * set. Gives up rather than waiting if another worker
+ * is doing the same. Returns non-zero if it wasn't kept, which isn't an error.
+ * */
+#endif
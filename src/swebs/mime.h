@@ -0,0 +1,75 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_MIME
+#define HAVE_MIME
+#include <stddef.h>
+
+#define MIME_ANY 0
+/* The ID of *, both tables start out with it */
+#define MIME_UNKNOWN (-1)
+/* Names that no rule uses */
+#define ACCEPT_MAX_RANGES 32
+/* Accept headers with more media ranges than this accept everything instead.
+ * Ranges naming types that no rule uses don't count. */
+#define ACCEPT_MAX_Q 1000
+/* q-values are kept in thousandths */
+
+typedef struct {
+	int type;
+	int subtype;
+} MimeType;
+
+typedef struct {
+	char **names;
+	size_t count;
+	size_t alloc;
+	/* Lowercase, the index is the ID */
+} MimeNames;
+
+typedef struct {
+	MimeNames types;
+	MimeNames subtypes;
+} MimeTable;
+
+typedef struct {
+	MimeType range;
+	int q;
+} AcceptRange;
+
+typedef struct {
+	AcceptRange ranges[ACCEPT_MAX_RANGES];
+	size_t count;
+} AcceptList;
+
+void initMimeTable(MimeTable *table);
+void freeMimeTable(MimeTable *table);
+MimeType internMime(MimeTable *table, const char *contenttype);
+/*
+ * Turns a rule's Content-Type into IDs, adding names the table doesn't have
+ * yet. Parameters like charset are skipped. Only for setup, this uses
+ * xmalloc().
+ * */
+void parseAccept(const MimeTable *table, const char *accept,
+		AcceptList *ret);
+/* An Accept header without any media ranges in it accepts everything */
+int acceptQuality(const AcceptList *accept, MimeType mime);
+/*
+ * The q-value of the most specific range that matches mime, 0 if none do
+ * (which is the same as the client saying it doesn't want it)
+ * */
+#endif
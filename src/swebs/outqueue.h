@@ -0,0 +1,99 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_OUTQUEUE
+#define HAVE_OUTQUEUE
+#include <stddef.h>
+#include <sys/types.h>
+
+#include <swebs/sockets.h>
+
+#define OUT_CHUNK 16384
+/* How much of a file is read at a time */
+#define OUT_ZEROCOPY (1 << 20)
+/* The most that one sendfile() or splice() call is asked to send */
+#define OUT_COALESCE 4096
+/* Small buffers and files are copied into shared buffers of this size, so that
+ * a batch of pipelined responses can go out in a few large writes. */
+
+typedef enum {
+	OUT_BUFFER,
+	OUT_FILE,
+	OUT_PIPE
+	/* sent with chunked transfer encoding */
+} OutType;
+
+typedef enum {
+	OUT_READ,
+	OUT_SENDFILE,
+	OUT_SPLICE
+} OutCopy;
+/* How a file gets to a TCP or kTLS socket, other TLS streams read it in */
+
+typedef struct OutItem {
+	OutType type;
+	OutCopy copy;
+	char *data;
+	/* For buffers this is the buffer, for files and pipes it's the chunk
+	 * that was last read. */
+	size_t len;
+	size_t sent;
+	size_t alloc;
+	/* how much room data has, other things can be added to the end of a
+	 * buffer while there's space left */
+	int fd;
+	/* -1 once a pipe has hit EOF */
+	size_t left;
+	/* the amount of the file that hasn't been read yet */
+	off_t offset;
+	/* where the rest of the file starts, -1 to go from fd's own offset */
+	struct OutItem *next;
+} OutItem;
+
+typedef struct {
+	OutItem *head;
+	OutItem *tail;
+	const char *connfields;
+	/* Header lines about the connection itself (like Connection: close),
+	 * added to every response queued. NULL if there aren't any. */
+} OutQueue;
+/* Everything that still has to be sent on a connection, in order. */
+
+void initQueue(OutQueue *queue);
+void freeQueue(OutQueue *queue);
+/* frees everything in the queue and closes any files */
+char *queueSpace(OutQueue *queue, size_t len);
+/* Returns len bytes at the end of the queue to be filled in, or NULL on error.
+ * Whatever is put there is sent after everything already in the queue. */
+void unqueueSpace(OutQueue *queue, size_t len);
+/* Takes back the last len bytes handed out by queueSpace(), as long as nothing
+ * else has been queued since */
+int queueBuffer(OutQueue *queue, void *data, size_t len, int copy);
+/* If copy is zero then the queue takes ownership of data and frees it once it's
+ * sent, even if this fails. */
+int queueFile(OutQueue *queue, int fd, off_t offset, size_t len);
+/* Files under OUT_COALESCE bytes are read in right away. offset is where the
+ * response starts in fd, or -1 for pipes. Giving an offset leaves fd's own
+ * offset alone, so fds that share it can be sent at the same time. */
+int queuePipe(OutQueue *queue, int fd);
+/* These take ownership of fd. All of these return non-zero on error. */
+int queueEmpty(OutQueue *queue);
+
+int flushQueue(OutQueue *queue, Stream *stream);
+/* Sends as much as possible without blocking. Returns 0 once the queue is
+ * empty, 1 if the stream can't take any more right now, and -1 on error. */
+#endif
@@ -17,21 +17,44 @@
 */
 #ifndef HAVE_RESPONSE_UTIL
 #define HAVE_RESPONSE_UTIL
-#include <swebs/sockets.h>
+#include <swebs/outqueue.h>
 
+#define CONTINUE  "HTTP/1.1 100 Continue\r\n\r\n"
+/* Sent as is before reading a body the client is waiting to send */
 #define CODE_200  "200 OK"
 #define ERROR_400 "400 Bad Request"
 #define ERROR_403 "403 Forbidden"
 #define ERROR_404 "404 Not Found"
+#define ERROR_413 "413 Content Too Large"
 #define ERROR_500 "500 Internal Server Error"
 
 char *getCode(int code);
-int sendStringResponse(Stream *stream, const char *status, char *str, ...);
-int sendBinaryResponse(Stream *stream, const char *status,
+int sendStringResponse(OutQueue *out, const char *status, char *str, ...);
+int sendBinaryResponse(OutQueue *out, const char *status,
 		void *data, size_t len, ...);
-int sendErrorResponse(Stream *stream, const char *error);
-/* sendErrorResponse(conn, ERROR_404); */
-int sendSeekableFile(Stream *stream, const char *status, int fd, ...);
-int sendPipe(Stream *stream, const char *status, int fd, ...);
-int sendKnownPipe(Stream *stream, const char *status, int fd, size_t len, ...);
+int sendErrorResponse(OutQueue *out, const char *error);
+/* sendErrorResponse(&conn->out, ERROR_404); */
+/* These all add a response to out rather than sending it straight away. Any fd
+ * passed in is owned by out afterwards. */
+int sendSeekableFile(OutQueue *out, const char *status, int fd, ...);
+int sendPipe(OutQueue *out, const char *status, int fd, ...);
+int sendKnownPipe(OutQueue *out, const char *status, int fd, size_t len, ...);
+int sendOpenFile(OutQueue *out, const char *status, int fd, size_t len, ...);
+/* Sends the first len bytes of a file without touching fd's offset, for fds
+ * that are dup()ed from one that's kept open */
+
+char *buildResponse(const char *status, const void *body, size_t len,
+		size_t *total, size_t *split, ...);
+/*
+ * Formats a whole response ahead of time, returning it in a malloc()ed buffer
+ * that's *total bytes long or NULL on error. The arguments after split are
+ * extra header lines ending in a NULL, like with the other functions. The lines
+ * about the connection are left out and go in at *split when it's sent.
+ * */
+int sendPrebuilt(OutQueue *out, const char *response, size_t len,
+		size_t split);
+/* Queues a response from buildResponse() with a single copy */
+void unsendPrebuilt(OutQueue *out, size_t len);
+/* Takes back the response that sendPrebuilt() just queued, for when it turns
+ * out to have been changed while it was being copied */
 #endif
@@ -0,0 +1,127 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_ROUTES
+#define HAVE_ROUTES
+#include <stddef.h>
+
+#include <swebs/types.h>
+#include <swebs/automaton.h>
+
+#define ROUTE_HOST 1
+#define ROUTE_PATH 2
+/* Flags for the parts of a rule that still need regexec() */
+#define ROUTE_CACHE_SETS 256
+#define ROUTE_CACHE_WAYS 4
+/* The decision cache has ROUTE_CACHE_SETS sets of ROUTE_CACHE_WAYS entries,
+ * ROUTE_CACHE_SETS must be a power of 2 */
+#define ROUTE_CACHE_KEY 240
+/* Requests where the host, path and Accept header add up to more than this
+ * many bytes aren't cached */
+#define ROUTE_NONE (-1)
+#define ROUTE_UNKNOWN (-2)
+
+typedef struct {
+	char *host;
+	char *path;
+	/* Lowercase literals, host is NULL for a regex */
+	int *rules;
+	size_t count;
+	size_t alloc;
+	/* Indices into the sitefile, in sitefile order */
+} RouteEntry;
+
+typedef struct {
+	RouteEntry *entries;
+	size_t mask;
+	size_t used;
+	/* Rules with literal paths, open addressed. entries is NULL until the
+	 * first one is added. */
+	Automaton paths;
+	/* Rules with regex paths */
+	Automaton hosts;
+	/* Rules with regex hosts */
+} RouteBucket;
+/* The rules for one port and one method */
+
+typedef struct {
+	unsigned long hash;
+	unsigned long used;
+	/* When the entry was last hit, the least recent one in a set goes */
+	int rule;
+	/* The winning rule, ROUTE_NONE if nothing matched or ROUTE_UNKNOWN if
+	 * it hasn't been filled in */
+	size_t portind;
+	RequestType type;
+	size_t keylen;
+	char key[ROUTE_CACHE_KEY];
+	/* host, path and Accept with NUL bytes between them, keylen is 0 for
+	 * unused entries */
+} RouteCacheEntry;
+
+typedef struct {
+	RouteBucket *buckets;
+	size_t portcount;
+	char **hosts;
+	size_t rulecount;
+	/* Each rule's literal host, NULL if it's a regex */
+	RouteCacheEntry *cache;
+	unsigned long clock;
+	/* Allocated on first use, so every worker gets its own */
+} Routes;
+
+typedef struct {
+	const int *lists[3];
+	size_t left[3];
+	const int *hostmatches;
+	size_t hostcount;
+	char **hosts;
+	char *host;
+} RouteIter;
+
+int initRoutes(Routes *routes, size_t portcount);
+/* returns non-zero on error */
+void freeRoutes(Routes *routes);
+int addRoute(Routes *routes, size_t portind, RequestType type,
+		const char *host, const char *path, int rule);
+/*
+ * host and path are the rule's regexes. Rules have to be added in order.
+ * Returns -1 on error, otherwise ROUTE_HOST and ROUTE_PATH are set if that
+ * regex was too much for the automaton, in which case it's routed as if it
+ * were .* and has to be checked afterwards.
+ * */
+void finishRoutes(Routes *routes);
+/* Call once every rule has been added */
+int findRoutes(Routes *routes, size_t portind, RequestType type,
+		char *host, char *path, RouteIter *iter);
+int nextRoute(RouteIter *iter);
+/*
+ * Goes through every rule that matches host and path, in sitefile order.
+ * nextRoute() returns -1 once there are none left. findRoutes() returns
+ * non-zero on error.
+ * */
+RouteCacheEntry *cachedRoute(Routes *routes, size_t portind,
+		RequestType type, const char *host, const char *path,
+		const char *accept);
+/*
+ * Returns the cached decision for a request. On a miss the least recently
+ * used entry is taken over and its rule is ROUTE_UNKNOWN, the caller fills
+ * it in once it knows. Returns NULL if the request can't be cached. The
+ * cache goes away with the rest of the routes, so a new sitefile starts off
+ * with an empty one.
+ * */
+#endif
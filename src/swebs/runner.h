@@ -23,13 +23,28 @@
 #include <swebs/sitefile.h>
 #include <swebs/connections.h>
 
+#define ACCEPT_RETRY 100
+/* How long in milliseconds a worker that has run out of fds waits before it
+ * tries to accept connections again */
+
 typedef struct {
 	int valid;
 	int portind;
 } ConnInfo;
 
-void runServer(int connfd, Sitefile *site, volatile int *pending, int id);
-/* pending and info are shared memory. pending[id] is the amount of connections
- * that are being processed by that process, and info contains info about the
- * connection being sent through. */
+typedef struct {
+	volatile int connections;
+	/* open connections, including ones that the master has sent but the
+	 * worker hasn't picked up yet */
+	volatile int requests;
+	/* connections that are partway through a request */
+} WorkerLoad;
+/* Lives in shared memory, only ever changed with atomic operations since the
+ * master and the worker both write to it. */
+
+void runServer(int connfd, Sitefile *site, Listener **listeners,
+		WorkerLoad *loads, int id);
+/* loads is shared memory, loads[id] is the load of this process. listeners is
+ * either NULL if connections are sent through connfd, or one listener per port
+ * if this process accepts its own connections. */
 #endif
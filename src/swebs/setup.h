@@ -21,8 +21,15 @@
 #include <swebs/sockets.h>
 #include <swebs/sitefile.h>
 
+typedef enum {
+	LEAST_CONNECTIONS,
+	TWO_CHOICES,
+	ROUND_ROBIN
+} BalancePolicy;
+/* How the master picks a worker for new connections */
+
 void setup(int argc, char **argv, Sitefile **site, int *processes,
-		int *backlog);
+		int *backlog, int *reuseport, BalancePolicy *policy);
 /* Setup parses args, utilizes them, and returns only what is needed in the
  * main loop. */
 
@@ -21,6 +21,9 @@
 
 #include <swebs/types.h>
 #include <swebs/config.h>
+#include <swebs/mime.h>
+#include <swebs/filecache.h>
+#include <swebs/routes.h>
 
 typedef enum {
 	READ,
@@ -32,6 +35,11 @@ typedef struct {
 	SocketType type;
 	unsigned short num;
 	int timeout;
+	int keepalive;
+	/* How long idle connections are kept in milliseconds, 0 turns
+	 * keep-alive off and -1 means the same as timeout. */
+	long maxrequests;
+	/* Requests per connection before it's closed, 0 for no limit */
 	char *key;
 	char *cert;
 	/* key and cert are possible unused */
@@ -42,10 +50,17 @@ typedef struct {
 	regex_t host;
 	Command command;
 	regex_t path;
+	char *hostpattern;
+	char *pathpattern;
+	int recheck;
+	/* The routing index takes care of host and path unless they're flagged
+	 * in recheck (ROUTE_HOST and ROUTE_PATH) */
 	char *arg;
 	unsigned short *ports;
 	int portcount;
 	char *contenttype;
+	MimeType mime;
+	/* contenttype as IDs from the sitefile's MimeTable */
 } SiteCommand;
 
 typedef struct {
@@ -57,6 +72,14 @@ typedef struct {
 	size_t portalloc;
 	Port *ports;
 
+	MimeTable mime;
+	/* Every type and subtype the rules use */
+	Routes routes;
+	/* The rules bucketed by port and method, filled in once the whole
+	 * sitefile has been read */
+	FileCache files;
+	/* Files that read rules have already resolved and opened */
+
 #if DYNAMIC_LINKED_PAGES
 	int (*getResponse)(Request *, Response *);
 #endif
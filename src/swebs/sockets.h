@@ -19,6 +19,7 @@
 #define HAVE_SOCKETS
 #include <stddef.h>
 
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <gnutls/gnutls.h>
 
@@ -41,10 +42,15 @@ typedef struct {
 	SocketType type;
 	int fd;
 	gnutls_session_t session;
+	int ktls;
+	/* The kernel encrypts what's written to fd, so files can be sent
+	 * with sendfile() even though this is TLS */
 } Stream;
 
 int initTLS();
-Listener *createListener(uint16_t port, int backlog);
+Listener *createListener(uint16_t port, int backlog, int reuseport);
+/* If reuseport is set, then several listeners can share the same port and the
+ * kernel spreads connections between them. */
 int listenerfd(Listener *listener);
 Context *createContext(SocketType type, ...);
 /*
@@ -53,9 +59,20 @@ Context *createContext(SocketType type, ...);
  * tls: (char *keyfile, char *certfile)
  * */
 int acceptConnection(Listener *listener);
-/* Returns a file descriptor from the listener */
+/* Returns a file descriptor from the listener, or -1 with errno set to EAGAIN
+ * if there are no more pending connections. Listeners are always non
+ * blocking. */
 Stream *createStream(Context *context, int flags, int fd);
-/* flags are fcntl flags */
+/* flags are fcntl flags, fd is closed on error. TLS streams have to go through
+ * handshakeStream() before anything is sent or received. */
+int handshakeStream(Stream *stream);
+/* Moves the TLS handshake along as far as it can without blocking. Returns 0
+ * once the handshake is done (or for TCP streams), 1 if it should be called
+ * again once there's more data, and -1 on error. ktls is set once it's done. */
+int handshakeWriting(Stream *stream);
+/* Returns non-zero if handshakeStream() last stopped because the socket
+ * couldn't take any more, so it has to wait for the fd to be writable instead
+ * of readable */
 
 void freeListener(Listener *listener);
 void freeContext(Context *context);
@@ -64,4 +81,8 @@ void freeStream(Stream *stream);
 ssize_t sendStream(Stream *stream, const void *data, size_t len);
 ssize_t recvStream(Stream *stream, void *data, size_t len);
 /* return value is the same as the read and write syscalls. */
+ssize_t sendStreamv(Stream *stream, const struct iovec *iov, int iovcnt);
+/* Sends several buffers at once, with writev() on TCP and as a single record on
+ * TLS. This can send less than everything, the return value is the same as
+ * sendStream(). */
 #endif
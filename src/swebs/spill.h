@@ -0,0 +1,35 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_SPILL
+#define HAVE_SPILL
+#include <stddef.h>
+#include <sys/types.h>
+
+int createSpill(void);
+/* Returns an anonymous file (a memfd, or a deleted temporary file on systems
+ * without them) to hold a request body, or -1 on error. */
+int writeSpill(int fd, const void *data, size_t len);
+/* Writes all of data, returns non-zero on error */
+ssize_t spliceSpill(int sock, int fd, size_t len, int pipes[2]);
+/*
+ * Moves up to len bytes from sock to the end of fd without copying them
+ * through userspace. pipes is a pipe that's created on the first call if
+ * pipes[0] is -1 and can be reused after that. The return value is the same as
+ * read(), sock has to be non blocking.
+ * */
+#endif
@@ -0,0 +1,68 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_TIMER
+#define HAVE_TIMER
+
+#define TIMER_TICK 10
+/* The resolution of timers in milliseconds */
+#define TIMER_LEVELS 4
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+/* The first level of the wheel has 2^8 slots of 1 tick each, every level after
+ * that has 2^6 slots that are each as long as the whole level before it. With
+ * 10ms ticks the levels cover 2.56 seconds, 2.7 minutes, 2.9 hours, and 7.7
+ * days. Longer timeouts get clamped. */
+
+typedef struct {
+	int prev;
+	int next;
+	long expires;
+	int slot;
+	/* -1 if the timer isn't set */
+} TimerNode;
+
+typedef struct {
+	TimerNode *nodes;
+	int nodealloc;
+	/* nodes[id] is the timer with that id, ids are usually fds. */
+	int *slots;
+	/* the first id in each slot, or -1 */
+	long now;
+	/* the next tick that hasn't gone off yet */
+	int count;
+} TimerWheel;
+
+void updateTime(void);
+long currentTime(void);
+/* milliseconds since some arbitrary point. This is cached and only changes when
+ * updateTime() is called, which should be once per event loop. */
+
+int createTimerWheel(TimerWheel *wheel);
+void freeTimerWheel(TimerWheel *wheel);
+int setTimer(TimerWheel *wheel, int id, long timeout);
+/* (re)sets the timer for id to go off in timeout milliseconds, returns
+ * non-zero on error */
+void clearTimer(TimerWheel *wheel, int id);
+int timerSet(TimerWheel *wheel, int id);
+int nextTimer(TimerWheel *wheel);
+/* returns the amount of milliseconds until a timer could go off or -1 if there
+ * are no timers, meant to be given to poll() */
+int expireTimer(TimerWheel *wheel);
+/* returns the id of a timer that has gone off and clears it, or -1 if there are
+ * no more. */
+#endif
@@ -47,7 +47,8 @@ typedef struct {
 	 * once. */
 	size_t len;
 	size_t allocatedLen;
-	/* The amount of bytes allocated, for internal use. */
+	/* The amount of bytes allocated, for internal use. 0 if data points
+	 * into a buffer owned by something else. */
 } BinaryString;
 
 typedef struct {
@@ -59,6 +60,8 @@ typedef struct {
 	BinaryString path;
 	long fieldCount;
 	PathField *fields;
+	/* No longer filled in, fieldCount is always 0. Use getQuery() and
+	 * nextQuery() instead. */
 } Path;
 
 typedef struct {
@@ -66,15 +69,76 @@ typedef struct {
 	char *value;
 } Field;
 
-typedef struct {
+typedef enum {
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_AUTHORIZATION,
+	HEADER_CACHE_CONTROL,
+	HEADER_CONNECTION,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_COOKIE,
+	HEADER_EXPECT,
+	HEADER_HOST,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_NONE_MATCH,
+	HEADER_KEEP_ALIVE,
+	HEADER_ORIGIN,
+	HEADER_RANGE,
+	HEADER_REFERER,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_UPGRADE,
+	HEADER_USER_AGENT,
+	HEADER_COUNT
+	/* Also used for headers that aren't any of these */
+} HeaderName;
+/* Headers that get looked up often enough to be worth recognizing */
+
+typedef struct Request {
 	long fieldCount;
 	Field *fields;
 	Path path;
 	RequestType type;
 	void *body;
 	size_t bodylen;
+	long known[HEADER_COUNT];
+	/* The index into fields of each well known header, -1 if the request
+	 * didn't have it. Use getHeader() instead of reading this directly. */
+	int bodyfd;
+	/* Big bodies don't fit in memory. If this isn't -1 then body is NULL
+	 * and the body is the bodylen bytes of this file, which is at offset
+	 * 0 and is closed by swebs afterwards. */
+	char *query;
+	/* The raw query string after the '?', NULL if there isn't one */
+	BinaryString *(*getQuery)(struct Request *request, char *var);
+	int (*nextQuery)(struct Request *request, long *pos,
+			BinaryString *var, BinaryString *value);
+	void *internal;
+	/* Query parameters are only decoded when asked for, see getQuery()
+	 * and nextQuery() below. These are function pointers so that
+	 * libraries don't need anything exported from swebs itself. */
 } Request;
 
+#define getHeader(request, name) ((request)->known[name] < 0 ? NULL : \
+		(request)->fields[(request)->known[name]].value)
+/* The value of a well known header or NULL, for example
+ * getHeader(request, HEADER_HOST) */
+#define getQuery(request, var) ((request)->getQuery((request), (var)))
+/* The decoded value of the first var in the query string or NULL */
+#define nextQuery(request, pos, var, value) \
+	((request)->nextQuery((request), (pos), (var), (value)))
+/*
+ * Goes through the query string one var=value pair at a time:
+ *
+ * long pos = 0;
+ * BinaryString var, value;
+ * while (nextQuery(request, &pos, &var, &value) > 0)
+ * 	...
+ *
+ * Returns 1 for each pair, 0 at the end and -1 if a pair is malformed.
+ * */
+
 typedef enum {
 	FILE_KNOWN_LENGTH,
 	FILE_UNKNOWN_LENGTH,
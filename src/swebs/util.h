@@ -42,9 +42,21 @@ int createFormatLog(char *fmt, ...);
 int istrcmp(char *s1, char *s2);
 /* case insensitive strcmp */
 RequestType getType(char *str);
+HeaderName getHeaderName(char *str, size_t len);
+/* Case insensitive, returns HEADER_COUNT for headers that aren't well known */
+char *scanChar(char *data, size_t len, char c);
+/* memchr() for the parser, returns the first c in data or NULL. Uses AVX2/SSE2
+ * when the compiler targets them, 32/16 bytes per compare. */
 
-void sendFd(int fd, int dest, void *data, size_t len);
-int recvFd(int source, void *data, size_t len);
+#define MAX_FD_BATCH 64
+/* The most fds that get sent in a single message, must be under SCM_MAX_FD */
+
+int sendFds(int *fds, int count, int dest, void *data, size_t each);
+int recvFds(int source, int *fds, int maxfds, void *data, size_t each);
+/* Sends/receives up to MAX_FD_BATCH fds in one message, along with each bytes
+ * of data for every fd. recvFds() returns the amount of fds received or -1 on
+ * error, which includes messages that don't have exactly that much data.
+ * sendFds() returns non-zero on error. */
 
 int createTmpName(char *path);
 /* WIll set the 5 characters at the end of path to random data so that that
@@ -0,0 +1,34 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef HAVE_ZEROCOPY
+#define HAVE_ZEROCOPY
+#include <stddef.h>
+#include <sys/types.h>
+
+ssize_t sendFileZerocopy(int sock, int fd, off_t *offset, size_t len);
+/* Sends up to len bytes of a regular file with sendfile(), starting at and
+ * moving *offset along. If offset is NULL fd's own offset is used. */
+ssize_t sendPipeZerocopy(int sock, int fd, size_t len);
+/*
+ * Moves up to len bytes from a pipe to sock with splice(). This blocks until
+ * there's something in the pipe, the same way read() would, but not on sock.
+ * */
+/* Both of these return the same thing as write(), sock has to be non blocking.
+ * EINVAL means that the kernel can't do it for this fd and it has to be read
+ * in instead. */
+#endif
@@ -0,0 +1,223 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <time.h>
+#include <stdlib.h>
+
+#include <swebs/timer.h>
+
+#define ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define ROOT_MASK (ROOT_SIZE - 1)
+#define LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define LEVEL_MASK (LEVEL_SIZE - 1)
+#define SLOT_COUNT (ROOT_SIZE + LEVEL_SIZE * (TIMER_LEVELS - 1))
+#define EXPIRED SLOT_COUNT
+/* Timers that have gone off but haven't been returned by expireTimer() yet */
+#define MAX_TICKS ((1L << (TIMER_ROOT_BITS + \
+		TIMER_LEVEL_BITS * (TIMER_LEVELS - 1))) - 1)
+
+static long cachedTime;
+
+void updateTime(void) {
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC_COARSE, &now) &&
+	    clock_gettime(CLOCK_MONOTONIC, &now))
+		return;
+	cachedTime = now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long currentTime(void) {
+	return cachedTime;
+}
+
+int createTimerWheel(TimerWheel *wheel) {
+	int i;
+	wheel->nodealloc = 100;
+	wheel->nodes = malloc(wheel->nodealloc * sizeof *wheel->nodes);
+	if (wheel->nodes == NULL)
+		return 1;
+	for (i = 0; i < wheel->nodealloc; ++i)
+		wheel->nodes[i].slot = -1;
+	wheel->slots = malloc((SLOT_COUNT + 1) * sizeof *wheel->slots);
+	if (wheel->slots == NULL) {
+		free(wheel->nodes);
+		return 1;
+	}
+	for (i = 0; i < SLOT_COUNT + 1; ++i)
+		wheel->slots[i] = -1;
+	updateTime();
+	wheel->now = currentTime() / TIMER_TICK;
+	wheel->count = 0;
+	return 0;
+}
+
+void freeTimerWheel(TimerWheel *wheel) {
+	free(wheel->nodes);
+	free(wheel->slots);
+}
+
+static void linkTimer(TimerWheel *wheel, int id, int slot) {
+	TimerNode *node = wheel->nodes + id;
+	node->slot = slot;
+	node->prev = -1;
+	node->next = wheel->slots[slot];
+	if (node->next >= 0)
+		wheel->nodes[node->next].prev = id;
+	wheel->slots[slot] = id;
+}
+
+static void unlinkTimer(TimerWheel *wheel, int id) {
+	TimerNode *node = wheel->nodes + id;
+	if (node->prev >= 0)
+		wheel->nodes[node->prev].next = node->next;
+	else
+		wheel->slots[node->slot] = node->next;
+	if (node->next >= 0)
+		wheel->nodes[node->next].prev = node->prev;
+	node->slot = -1;
+}
+
+static void place(TimerWheel *wheel, int id) {
+/* Puts a timer into the right slot for its expiry time */
+	long expires, ticks;
+	int level;
+	expires = wheel->nodes[id].expires;
+	ticks = expires - wheel->now;
+	if (ticks < 0) {
+		linkTimer(wheel, id, wheel->now & ROOT_MASK);
+		return;
+	}
+	if (ticks < ROOT_SIZE) {
+		linkTimer(wheel, id, expires & ROOT_MASK);
+		return;
+	}
+	if (ticks > MAX_TICKS) {
+		expires = wheel->now + MAX_TICKS;
+		wheel->nodes[id].expires = expires;
+	}
+	for (level = 1; level < TIMER_LEVELS - 1; ++level)
+		if (ticks < 1L << (TIMER_ROOT_BITS + TIMER_LEVEL_BITS * level))
+			break;
+	linkTimer(wheel, id, ROOT_SIZE + (level - 1) * LEVEL_SIZE +
+			((expires >> (TIMER_ROOT_BITS +
+				TIMER_LEVEL_BITS * (level - 1))) & LEVEL_MASK));
+}
+
+static int cascade(TimerWheel *wheel, int level) {
+/* Moves the timers in the current slot of level down a level. Returns the
+ * index of that slot. */
+	int index, slot;
+	index = (wheel->now >> (TIMER_ROOT_BITS +
+			TIMER_LEVEL_BITS * (level - 1))) & LEVEL_MASK;
+	slot = ROOT_SIZE + (level - 1) * LEVEL_SIZE + index;
+	while (wheel->slots[slot] >= 0) {
+		int id = wheel->slots[slot];
+		unlinkTimer(wheel, id);
+		place(wheel, id);
+	}
+	return index;
+}
+
+static void tick(TimerWheel *wheel) {
+/* Moves everything in the current slot to EXPIRED and moves on to the next
+ * tick. */
+	int index, level;
+	index = wheel->now & ROOT_MASK;
+	if (index == 0)
+		for (level = 1; level < TIMER_LEVELS; ++level)
+			if (cascade(wheel, level) != 0)
+				break;
+	while (wheel->slots[index] >= 0) {
+		int id = wheel->slots[index];
+		unlinkTimer(wheel, id);
+		linkTimer(wheel, id, EXPIRED);
+	}
+	++wheel->now;
+}
+
+int setTimer(TimerWheel *wheel, int id, long timeout) {
+	if (id >= wheel->nodealloc) {
+		int newalloc, i;
+		TimerNode *newnodes;
+		newalloc = wheel->nodealloc;
+		while (newalloc <= id)
+			newalloc *= 2;
+		newnodes = realloc(wheel->nodes, newalloc * sizeof *newnodes);
+		if (newnodes == NULL)
+			return 1;
+		for (i = wheel->nodealloc; i < newalloc; ++i)
+			newnodes[i].slot = -1;
+		wheel->nodes = newnodes;
+		wheel->nodealloc = newalloc;
+	}
+	clearTimer(wheel, id);
+	wheel->nodes[id].expires = (currentTime() + timeout + TIMER_TICK - 1) /
+		TIMER_TICK;
+	place(wheel, id);
+	++wheel->count;
+	return 0;
+}
+
+void clearTimer(TimerWheel *wheel, int id) {
+	if (!timerSet(wheel, id))
+		return;
+	unlinkTimer(wheel, id);
+	--wheel->count;
+}
+
+int timerSet(TimerWheel *wheel, int id) {
+	return id >= 0 && id < wheel->nodealloc && wheel->nodes[id].slot >= 0;
+}
+
+int nextTimer(TimerWheel *wheel) {
+	long next;
+	int i;
+	if (wheel->count == 0)
+		return -1;
+	if (wheel->slots[EXPIRED] >= 0)
+		return 0;
+	next = (wheel->now | ROOT_MASK) + 1;
+	/* If the first level is empty then something will have to be
+	 * cascaded down when it wraps around */
+	for (i = 0; i < ROOT_SIZE; ++i) {
+		if (wheel->slots[(wheel->now + i) & ROOT_MASK] >= 0) {
+			next = wheel->now + i;
+			break;
+		}
+	}
+	next = next * TIMER_TICK - currentTime();
+	return next < 0 ? 0 : next;
+}
+
+int expireTimer(TimerWheel *wheel) {
+	const long target = currentTime() / TIMER_TICK;
+	int id;
+	if (wheel->count == 0) {
+		wheel->now = target + 1;
+		return -1;
+	}
+	/* Nothing can go off, so there's no reason to go through every
+	 * tick. */
+	while (wheel->slots[EXPIRED] < 0 && wheel->now <= target)
+		tick(wheel);
+	id = wheel->slots[EXPIRED];
+	if (id < 0)
+		return -1;
+	unlinkTimer(wheel, id);
+	--wheel->count;
+	return id;
+}
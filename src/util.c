@@ -27,6 +27,11 @@
 #include <unistd.h>
 #include <sys/shm.h>
 #include <sys/socket.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <swebs/util.h>
 #include <swebs/types.h>
@@ -155,33 +160,134 @@ int istrcmp(char *s1, char *s2) {
 	}
 }
 
+static const char *const methodNames[INVALID] = {
+	"GET", "POST", "PUT", "HEAD", "DELETE", "PATCH", "OPTIONS"
+};
+/* In the same order as RequestType */
+
+static const unsigned char methodSlots[16] = {
+	HEAD, INVALID, INVALID, INVALID,
+	INVALID, INVALID, INVALID, PUT,
+	POST, OPTIONS, INVALID, INVALID,
+	INVALID, PATCH, GET, DELETE
+};
+/*
+ * Indexed by (length + first + last) % 16, which doesn't collide for any of
+ * the methods above. Methods are case sensitive, so unlike the header table
+ * the characters are hashed and compared as they are.
+ * */
+
 RequestType getType(char *str) {
-	if (strcmp(str, "GET") == 0)
-		return GET;
-	if (strcmp(str, "POST") == 0)
-		return POST;
-	if (strcmp(str, "PUT") == 0)
-		return PUT;
-	if (strcmp(str, "HEAD") == 0)
-		return HEAD;
-	if (strcmp(str, "DELETE") == 0)
-		return DELETE;
-	if (strcmp(str, "PATCH") == 0)
-		return PATCH;
-	if (strcmp(str, "OPTIONS") == 0)
-		return OPTIONS;
-	return INVALID;
+	size_t len = strlen(str);
+	RequestType ret;
+	if (len == 0)
+		return INVALID;
+	ret = methodSlots[(len + (unsigned char) str[0] +
+			(unsigned char) str[len - 1]) & 15];
+	if (ret == INVALID || strcmp(str, methodNames[ret]) != 0)
+		return INVALID;
+	return ret;
+}
+
+static const char *const headerNames[HEADER_COUNT] = {
+	"accept", "accept-encoding", "accept-language", "authorization",
+	"cache-control", "connection", "content-length", "content-type",
+	"cookie", "expect", "host", "if-modified-since", "if-none-match",
+	"keep-alive", "origin", "range", "referer", "transfer-encoding",
+	"upgrade", "user-agent"
+};
+/* In the same order as HeaderName */
+
+#define NONE HEADER_COUNT
+static const unsigned char headerSlots[64] = {
+	NONE, HEADER_REFERER, NONE, HEADER_CONTENT_TYPE,
+	HEADER_ACCEPT_LANGUAGE, NONE, NONE, NONE,
+	NONE, HEADER_KEEP_ALIVE, NONE, HEADER_RANGE,
+	HEADER_ACCEPT_ENCODING, NONE, HEADER_IF_MODIFIED_SINCE,
+	HEADER_USER_AGENT,
+	HEADER_UPGRADE, HEADER_CONTENT_LENGTH, NONE, NONE,
+	NONE, NONE, HEADER_IF_NONE_MATCH, NONE,
+	NONE, NONE, NONE, NONE,
+	NONE, NONE, NONE, NONE,
+	HEADER_CACHE_CONTROL, HEADER_TRANSFER_ENCODING, NONE, NONE,
+	NONE, HEADER_CONNECTION, HEADER_AUTHORIZATION, NONE,
+	NONE, NONE, NONE, NONE,
+	NONE, HEADER_ORIGIN, NONE, NONE,
+	NONE, NONE, NONE, NONE,
+	NONE, NONE, NONE, HEADER_ACCEPT,
+	NONE, NONE, NONE, HEADER_EXPECT,
+	HEADER_HOST, HEADER_COOKIE, NONE, NONE
+};
+#undef NONE
+/*
+ * Indexed by (length + first + 4 * last) % 64 using the lowercase first and
+ * last characters, which doesn't collide for any of the names above. Adding a
+ * header means finding a new hash that still doesn't.
+ * */
+
+HeaderName getHeaderName(char *str, size_t len) {
+	const char *name;
+	size_t i;
+	HeaderName ret;
+	if (len == 0)
+		return HEADER_COUNT;
+	ret = headerSlots[(len + tolower((unsigned char) str[0]) +
+			4 * tolower((unsigned char) str[len - 1])) & 63];
+	if (ret == HEADER_COUNT)
+		return HEADER_COUNT;
+	name = headerNames[ret];
+	for (i = 0; i < len; i++)
+		if (name[i] == '\0' || tolower((unsigned char) str[i]) != name[i])
+			return HEADER_COUNT;
+	return name[len] == '\0' ? ret : HEADER_COUNT;
 }
 
-void sendFd(int fd, int dest, void *data, size_t len) {
+char *scanChar(char *data, size_t len, char c) {
+	size_t i = 0;
+#if defined(__AVX2__)
+	{
+		const __m256i needle = _mm256_set1_epi8(c);
+		for (; i + 32 <= len; i += 32) {
+			__m256i chunk;
+			unsigned int mask;
+			chunk = _mm256_loadu_si256((__m256i *) (data + i));
+			mask = _mm256_movemask_epi8(
+					_mm256_cmpeq_epi8(chunk, needle));
+			if (mask)
+				return data + i + __builtin_ctz(mask);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	{
+		const __m128i needle = _mm_set1_epi8(c);
+		for (; i + 16 <= len; i += 16) {
+			__m128i chunk;
+			unsigned int mask;
+			chunk = _mm_loadu_si128((__m128i *) (data + i));
+			mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+			if (mask)
+				return data + i + __builtin_ctz(mask);
+		}
+	}
+#endif
+	for (; i < len; i++)
+		if (data[i] == c)
+			return data + i;
+	return NULL;
+}
+
+int sendFds(int *fds, int count, int dest, void *data, size_t each) {
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
 	char iobuf[1];
 	struct iovec io;
 	union {
-		char buf[CMSG_SPACE(sizeof(fd))];
+		char buf[CMSG_SPACE(sizeof(int) * MAX_FD_BATCH)];
 		struct cmsghdr align;
 	} u;
+	if (count <= 0 || count > MAX_FD_BATCH)
+		return 1;
 	memset(&msg, 0, sizeof(msg));
 	if (data == NULL) {
 		io.iov_base = iobuf;
@@ -189,39 +295,44 @@ void sendFd(int fd, int dest, void *data, size_t len) {
 	}
 	else {
 		io.iov_base = data;
-		io.iov_len = len;
+		io.iov_len = each * count;
 	}
 	msg.msg_iov = &io;
 	msg.msg_iovlen = 1;
 	msg.msg_control = u.buf;
-	msg.msg_controllen = sizeof(u.buf);
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
 	cmsg = CMSG_FIRSTHDR(&msg);
 	cmsg->cmsg_level = SOL_SOCKET;
 	cmsg->cmsg_type = SCM_RIGHTS;
-	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
-	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
-	sendmsg(dest, &msg, 0);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	return sendmsg(dest, &msg, 0) < 0;
 }
 
-int recvFd(int source, void *data, size_t len) {
+int recvFds(int source, int *fds, int maxfds, void *data, size_t each) {
 	union {
-		char buff[CMSG_SPACE(sizeof(int))];
+		char buff[CMSG_SPACE(sizeof(int) * MAX_FD_BATCH)];
 		struct cmsghdr align;
 	} cmsghdr;
 	struct msghdr msg;
 	struct cmsghdr *cmsg;
 	struct iovec iov;
 	ssize_t nr;
-	int ret;
+	size_t len;
+	int count, i;
 	char buf[1];
 
 	msg.msg_name = NULL;
 	msg.msg_namelen = 0;
+	msg.msg_flags = 0;
 
 	if (data == NULL) {
 		data = buf;
+		each = 0;
 		len = sizeof buf;
 	}
+	else
+		len = each * maxfds;
 	iov.iov_base = data;
 	iov.iov_len = len;
 	msg.msg_iov = &iov;
@@ -230,19 +341,35 @@ int recvFd(int source, void *data, size_t len) {
 	msg.msg_control = cmsghdr.buff;
 	msg.msg_controllen = sizeof(cmsghdr.buff);
 	nr = recvmsg(source, &msg, 0);
-	if (nr < 0)
+	if (nr <= 0)
 		return -1;
 
 	cmsg = CMSG_FIRSTHDR(&msg);
-	if (cmsg == NULL || cmsg->cmsg_len != CMSG_LEN(len))
+	if (cmsg == NULL || cmsg->cmsg_len < CMSG_LEN(sizeof(int)))
 		return -1;
 	if (cmsg->cmsg_level != SOL_SOCKET)
 		return -1;
 	if (cmsg->cmsg_type != SCM_RIGHTS)
 		return -1;
 
-	memcpy(&ret, CMSG_DATA(cmsg), sizeof(ret));
-	return ret;
+	count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (count > MAX_FD_BATCH)
+		count = MAX_FD_BATCH;
+	if (count > maxfds || msg.msg_flags & MSG_CTRUNC ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count) ||
+			(size_t) nr != (each == 0 ? sizeof buf : each * count)) {
+		for (i = 0; i < count; ++i) {
+			int extra;
+			memcpy(&extra, CMSG_DATA(cmsg) + i * sizeof(int),
+					sizeof extra);
+			close(extra);
+		}
+		return -1;
+	}
+	/* Every fd needs its data, anything else means the stream is out of
+	 * sync and can't be trusted */
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+	return count;
 }
 
 int createTmpName(char *path) {
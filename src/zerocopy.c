@@ -0,0 +1,49 @@
+/*
+   swebs - a simple web server
+   Copyright (C) 2022  Nate Choe
+   
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE
+/* splice(). Like spill.c, this file can't include gnutls. */
+#include <swebs/config.h>
+#include <swebs/zerocopy.h>
+#if USE_ZEROCOPY
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+ssize_t sendFileZerocopy(int sock, int fd, off_t *offset, size_t len) {
+	return sendfile(sock, fd, offset, len);
+}
+
+ssize_t sendPipeZerocopy(int sock, int fd, size_t len) {
+	return splice(fd, NULL, sock, NULL, len, SPLICE_F_MOVE);
+}
+#else
+#include <errno.h>
+
+ssize_t sendFileZerocopy(int sock, int fd, off_t *offset, size_t len) {
+	(void) sock;
+	(void) fd;
+	(void) offset;
+	(void) len;
+	errno = EINVAL;
+	return -1;
+}
+
+ssize_t sendPipeZerocopy(int sock, int fd, size_t len) {
+	return sendFileZerocopy(sock, fd, NULL, len);
+}
+#endif